@@ -6,6 +6,16 @@
  }}} */
 
 #include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
 #include "ActiveObject.h"
 
 #include "Event.h"
@@ -14,39 +24,163 @@
 namespace Event
 {
 
+namespace
+{
+
+int NativePolicy( ActiveObject::SchedulingPolicy aPolicy ) //{{{
+{
+  switch( aPolicy )
+  {
+    case ActiveObject::SchedulingFIFO: return SCHED_FIFO;
+    case ActiveObject::SchedulingRoundRobin: return SCHED_RR;
+    default: return SCHED_OTHER;
+  }
+} //}}}
+
+}
+
+void ActiveObject::SetScheduling( SchedulingPolicy aPolicy, int aPriority /*= 0*/ ) //{{{
+{
+  if( aPolicy != SchedulingOther
+      && ( aPriority < sched_get_priority_min( NativePolicy( aPolicy ) ) || aPriority > sched_get_priority_max( NativePolicy( aPolicy ) ) ) )
+  {
+    DBGOUT_FATAL( Debug::Prefix() << "Invalid real-time priority " << aPriority << std::endl );
+    throw std::runtime_error( "ActiveObject: invalid real-time priority" );
+  }
+
+  theSettings.thePolicy = aPolicy;
+  theSettings.thePriority = aPolicy == SchedulingOther ? 0 : aPriority;
+} //}}}
+
 void ActiveObject::Start() //{{{
 {
   DEBUG_TRACER;
 
   struct callable //{{{
   {
-    callable( EventProcessor & aProcessor ) : theProcessor( aProcessor ) {}
+    callable( ActiveObject & aObject ) : theObject( aObject ) {}
 
     void operator()()
     {
-      theProcessor.Run();
+      theObject.ThreadMain();
     }
     private:
 
-    EventProcessor &theProcessor;
+    ActiveObject &theObject;
   }; //}}}
 
-  callable cl( theEventProcessor );
+  callable cl( *this );
+
+  boost::unique_lock<boost::mutex> lock( theStartLock );
+  theThreadID = 0;
 
   boost::thread th( cl );
 
   theThread.swap( th );
+
+  // settings are in force and can be queried when Start returns
+  while( !theThreadID )
+    theStarted.wait( lock );
 } //}}}
 
 void ActiveObject::Stop() //{{{
 {
   DEBUG_TRACER;
 
-  theEventProcessor.PushEvent( EventPointer( new Event( EVENT_FINISH ) ) );
+  // EVENT_FINISH makes room for itself, it fails only while the lane holds control events alone
+  EventPointer finish( new Event( EVENT_FINISH, 0, PRIORITY_URGENT ) );
+  while( !theEventProcessor.PushEvent( finish ) )
+    boost::this_thread::yield();
+
+  // the handle must not be queried once the thread is joined
+  {
+    boost::lock_guard<boost::mutex> guard( theStartLock );
+    theThreadID = 0;
+  }
 
   theThread.join();
 } //}}}
 
+void ActiveObject::ThreadMain() //{{{
+{
+  ApplySettings();
+
+  {
+    boost::lock_guard<boost::mutex> guard( theStartLock );
+    theThreadID = syscall( SYS_gettid );
+    theNativeThread = pthread_self();
+    theStarted.notify_all();
+  }
+
+  theEventProcessor.Run();
+} //}}}
+
+void ActiveObject::ApplySettings() //{{{
+{
+  // failures are not fatal: the processor still works, only with default scheduling
+  if( !theSettings.theCPUs.empty() )
+  {
+    cpu_set_t cpus;
+    CPU_ZERO( &cpus );
+    for( std::vector< unsigned int >::const_iterator it = theSettings.theCPUs.begin(); it != theSettings.theCPUs.end(); ++it )
+      if( *it < CPU_SETSIZE )
+        CPU_SET( *it, &cpus );
+
+    int rc = pthread_setaffinity_np( pthread_self(), sizeof( cpus ), &cpus );
+    if( rc )
+      DBGOUT_WARNING( Debug::Prefix() << "Could not set CPU affinity: " << strerror( rc ) << std::endl );
+  }
+
+  if( theSettings.thePolicy != SchedulingOther )
+  {
+    sched_param param;
+    param.sched_priority = theSettings.thePriority;
+
+    int rc = pthread_setschedparam( pthread_self(), NativePolicy( theSettings.thePolicy ), &param );
+    if( rc )
+      DBGOUT_WARNING( Debug::Prefix() << "Could not set real-time priority " << theSettings.thePriority << ": " << strerror( rc ) << std::endl );
+  }
+  else if( theSettings.theNice )
+  {
+    if( setpriority( PRIO_PROCESS, syscall( SYS_gettid ), theSettings.theNice ) )
+      DBGOUT_WARNING( Debug::Prefix() << "Could not set nice level " << theSettings.theNice << ": " << strerror( errno ) << std::endl );
+  }
+} //}}}
+
+ActiveObject::ThreadSettings ActiveObject::GetEffectiveSettings() const //{{{
+{
+  boost::lock_guard<boost::mutex> guard( theStartLock );
+
+  if( !theThreadID )
+    return theSettings;
+
+  ThreadSettings settings;
+  pthread_t thread = theNativeThread;
+
+  int policy;
+  sched_param param;
+  if( 0 == pthread_getschedparam( thread, &policy, &param ) )
+  {
+    settings.thePolicy = policy == SCHED_FIFO ? SchedulingFIFO : policy == SCHED_RR ? SchedulingRoundRobin : SchedulingOther;
+    settings.thePriority = param.sched_priority;
+  }
+
+  errno = 0;
+  int nice = getpriority( PRIO_PROCESS, theThreadID );
+  if( !errno )
+    settings.theNice = nice;
+
+  cpu_set_t cpus;
+  if( 0 == pthread_getaffinity_np( thread, sizeof( cpus ), &cpus ) )
+  {
+    for( unsigned int cpu = 0; cpu < CPU_SETSIZE; ++cpu )
+      if( CPU_ISSET( cpu, &cpus ) )
+        settings.theCPUs.push_back( cpu );
+  }
+
+  return settings;
+} //}}}
+
 } // end namespace Event
 
 /* {{{ Modeline for ViM
@@ -10,6 +10,10 @@
 
 #include <boost/thread.hpp>
 
+#include <pthread.h>
+#include <sys/types.h>
+#include <vector>
+
 #include "Event.h"
 
 namespace Event
@@ -18,21 +22,66 @@ namespace Event
 class ActiveObject //{{{
 {
 public:
+  enum SchedulingPolicy
+  {
+    SchedulingOther,     //!< SCHED_OTHER, time sharing, adjusted by the nice level
+    SchedulingFIFO,      //!< SCHED_FIFO with the real-time priority
+    SchedulingRoundRobin //!< SCHED_RR with the real-time priority
+  };
+
+  //! \brief scheduling of the thread running the processor
+  struct ThreadSettings
+  {
+    ThreadSettings() : thePolicy( SchedulingOther ), thePriority( 0 ), theNice( 0 ) {}
+
+    SchedulingPolicy thePolicy;
+    int thePriority;                     //!< real-time priority, 1..99 for FIFO and RR
+    int theNice;                         //!< nice level, -20..19, SchedulingOther only
+    std::vector< unsigned int > theCPUs; //!< CPUs the thread may run on, empty for all
+  };
+
+  //! \param aPriority SCHED_FIFO priority of the thread, 0 for normal time sharing
   ActiveObject( EventProcessor &aEventProcessor, int aPriority = 0 )
-    : theEventProcessor( aEventProcessor ), thePriority( aPriority )
+    : theEventProcessor( aEventProcessor ), theThreadID( 0 )
   {
+    if( aPriority > 0 )
+    {
+      theSettings.thePolicy = SchedulingFIFO;
+      theSettings.thePriority = aPriority;
+    }
   };
 
+  //! \brief settings below are applied by the thread itself, before the first event; call before Start
+  void SetAffinity( const std::vector< unsigned int > & aCPUs ) { theSettings.theCPUs = aCPUs; }
+  void SetScheduling( SchedulingPolicy aPolicy, int aPriority = 0 );
+  void SetNice( int aNice ) { theSettings.theNice = aNice; }
+
+  //! \brief as requested
+  const ThreadSettings & GetSettings() const { return theSettings; }
+
+  //! \brief as set by the kernel, settings the process may not change (e.g. real-time without
+  //!        CAP_SYS_NICE) are reported with their actual value; the requested ones if not started
+  ThreadSettings GetEffectiveSettings() const;
+
   void Start();
   void Stop();
 
-  void PushEvent( const EventPointer & aEvent ) { theEventProcessor.PushEvent( aEvent ); }
+  bool PushEvent( const EventPointer & aEvent ) { return theEventProcessor.PushEvent( aEvent ); }
 
 private:
+  void ThreadMain();
+  void ApplySettings();
+
   EventProcessor &theEventProcessor;
   boost::thread theThread;
 
-  int thePriority;
+  ThreadSettings theSettings;
+
+  //! kernel thread ID, the nice level is per thread on Linux
+  pid_t theThreadID;
+  pthread_t theNativeThread;
+  mutable boost::mutex theStartLock;
+  boost::condition_variable theStarted;
 }; //}}}
 
 }
@@ -42,4 +91,3 @@ private:
 /* {{{ Modeline for ViM
  * vim600:fdm=marker fdl=0 fdc=3:
  * }}} */
-
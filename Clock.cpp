@@ -0,0 +1,183 @@
+/*! {{{ File head comment
+  \file Clock.cpp
+
+  \brief
+
+  }}} */
+
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#include <stdexcept>
+#include <string>
+
+#include <time.h>
+#include <unistd.h>
+
+#if defined( __x86_64__ )
+#include <cpuid.h>
+#include <x86intrin.h>
+#define CLOCK_HAS_TSC
+#endif
+
+#include "Clock.h"
+#include "SimulatedClock.h"
+#include "Debug.h"
+
+namespace Event
+{
+
+namespace
+{
+
+boost::atomic<int> theSource( Clock::SourceMonotonic );
+
+//! serializes changes of the source with the RealTimeUsers coming and going
+boost::mutex theSourceLock;
+unsigned int theRealTimeUsers = 0;
+
+boost::uint64_t ReadClock( clockid_t aClock ) //{{{
+{
+  timespec now;
+  clock_gettime( aClock, &now );
+
+  return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+} //}}}
+
+#ifdef CLOCK_HAS_TSC
+
+//! microseconds = theBase + ( ( tsc - theTSCBase ) * theMultiplier ) >> 32
+struct Calibration //{{{
+{
+  boost::uint64_t theBase;
+  boost::uint64_t theTSCBase;
+  boost::uint64_t theMultiplier;
+}; //}}}
+
+Calibration theCalibration;
+
+bool HasInvariantTSC() //{{{
+{
+  unsigned int eax, ebx, ecx, edx;
+  if( !__get_cpuid( 0x80000000, &eax, &ebx, &ecx, &edx ) || eax < 0x80000007 )
+    return false;
+
+  __get_cpuid( 0x80000007, &eax, &ebx, &ecx, &edx );
+  return edx & ( 1 << 8 );
+} //}}}
+
+void Calibrate() //{{{
+{
+  boost::uint64_t startTime = ReadClock( CLOCK_MONOTONIC );
+  boost::uint64_t startTSC = __rdtsc();
+
+  usleep( 20000 );
+
+  boost::uint64_t endTime = ReadClock( CLOCK_MONOTONIC );
+  boost::uint64_t endTSC = __rdtsc();
+
+  theCalibration.theBase = endTime;
+  theCalibration.theTSCBase = endTSC;
+  theCalibration.theMultiplier = ( ( endTime - startTime ) << 32 ) / ( endTSC - startTSC );
+} //}}}
+
+#endif
+
+}
+
+Clock::Source Clock::SetSource( Source aSource ) //{{{
+{
+  DEBUG_TRACER;
+
+  boost::lock_guard<boost::mutex> guard( theSourceLock );
+
+  if( aSource == SourceSimulated && theRealTimeUsers )
+  {
+    DBGOUT_FATAL( Debug::Prefix() << "SourceSimulated selected while a ProcessorScheduler or the TimerService exists\n" );
+    throw std::runtime_error( "Clock: SourceSimulated is not supported with a ProcessorScheduler or the TimerService" );
+  }
+
+  if( aSource == SourceTSC )
+  {
+#ifdef CLOCK_HAS_TSC
+    if( HasInvariantTSC() )
+    {
+      // calibrate once, readers only look at the calibration after the source is stored
+      if( theSource.load() != SourceTSC )
+        Calibrate();
+    }
+    else
+#endif
+    {
+      DBGOUT_WARNING( Debug::Prefix() << "No invariant TSC, using CLOCK_MONOTONIC\n" );
+      aSource = SourceMonotonic;
+    }
+  }
+
+  if( aSource == SourceSimulated && theSource.load() != SourceSimulated )
+    SimulatedClock::SetTime( Microseconds() );
+
+  theSource.store( aSource );
+
+  return aSource;
+} //}}}
+
+Clock::RealTimeUser::RealTimeUser( const char * aName ) //{{{
+{
+  boost::lock_guard<boost::mutex> guard( theSourceLock );
+
+  if( theSource.load() == SourceSimulated )
+  {
+    DBGOUT_FATAL( Debug::Prefix() << aName << " created with Clock::SourceSimulated\n" );
+    throw std::runtime_error( std::string( aName ) + ": not supported with Clock::SourceSimulated" );
+  }
+
+  ++theRealTimeUsers;
+} //}}}
+
+Clock::RealTimeUser::~RealTimeUser() //{{{
+{
+  boost::lock_guard<boost::mutex> guard( theSourceLock );
+
+  --theRealTimeUsers;
+} //}}}
+
+Clock::Source Clock::GetSource() //{{{
+{
+  return static_cast<Source>( theSource.load( boost::memory_order_relaxed ) );
+} //}}}
+
+boost::uint64_t Clock::Microseconds() //{{{
+{
+  switch( theSource.load( boost::memory_order_acquire ) )
+  {
+    case SourceCoarse:
+      return ReadClock( CLOCK_MONOTONIC_COARSE );
+
+    case SourceSimulated:
+      return SimulatedClock::Now();
+
+#ifdef CLOCK_HAS_TSC
+    case SourceTSC:
+    {
+      // another core may lag the calibrating one by a few cycles
+      boost::uint64_t tsc = __rdtsc();
+      if( tsc <= theCalibration.theTSCBase )
+        return theCalibration.theBase;
+
+      return theCalibration.theBase
+        + static_cast<boost::uint64_t>( ( static_cast<unsigned __int128>( tsc - theCalibration.theTSCBase ) * theCalibration.theMultiplier ) >> 32 );
+    }
+#endif
+
+    default:
+      return ReadClock( CLOCK_MONOTONIC );
+  }
+} //}}}
+
+} // end namespace Event
+
+/* {{{ Modeline for ViM
+ * vim600:fdm=marker fdl=0 fdc=3:
+ * }}} */
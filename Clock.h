@@ -0,0 +1,64 @@
+/*! {{{
+  \file Clock.h
+
+  \brief Monotonic time source of the timers
+
+  }}} */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <boost/cstdint.hpp>
+
+namespace Event
+{
+
+//! \brief process wide monotonic clock
+//!
+//! The time does not jump with NTP corrections, DST or changes of the
+//! wall clock. TimerSystem reads it once per event loop iteration, see
+//! TimerSystem::UpdateTime, so the source only needs to be fast, not exact
+//! to the microsecond.
+class Clock //{{{
+{
+public:
+  enum Source
+  {
+    SourceMonotonic, //!< CLOCK_MONOTONIC, vDSO, no system call (default)
+    SourceCoarse,    //!< CLOCK_MONOTONIC_COARSE, cheaper, resolution of a scheduler tick (1-4 ms)
+    SourceTSC,       //!< time stamp counter, calibrated against CLOCK_MONOTONIC
+    SourceSimulated  //!< virtual time, continues from the current time, see SimulatedClock
+  };
+
+  //! \brief select the source for all threads, before timers are started
+  //! SourceTSC needs an invariant TSC (x86-64), otherwise SourceMonotonic is used
+  //! SourceSimulated throws while a RealTimeUser exists
+  //! \return the source in effect
+  static Source SetSource( Source aSource );
+  static Source GetSource();
+
+  //! \brief time since an unspecified start, never goes backwards
+  static boost::uint64_t Microseconds();
+  static boost::uint64_t Milliseconds() { return Microseconds() / 1000; }
+
+  //! \brief base of what sleeps in real time until a deadline read from the clock
+  //! and so cannot follow SourceSimulated, constructing one throws while it is selected
+  class RealTimeUser //{{{
+  {
+  protected:
+    explicit RealTimeUser( const char * aName );
+    ~RealTimeUser();
+
+  private:
+    RealTimeUser( const RealTimeUser & );
+    RealTimeUser & operator=( const RealTimeUser & );
+  }; //}}}
+}; //}}}
+
+}
+
+#endif /* ifndef CLOCK_H */
+
+/* {{{ Modeline for ViM
+ * vim600:fdm=marker fdl=0 fdc=3:
+ * }}} */
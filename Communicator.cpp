@@ -34,48 +34,36 @@ EventProcessor::EventResult Communicator::GetEvent( EventPointer & aEvent, long
     if( ReadFromFD( aEvent ) == EventPresent )
       return EventPresent;
 
-  if( aMaxWaitTime != NO_WAIT )
-  {
-    pollfd pollFD[2];
-    pollFD[0].fd = thePipeFDs[0];
-    pollFD[0].events = POLLIN;
-
-    int maxFD = 1;
-
-    if( theReadFD >= 0 )
-    {
-      maxFD = 2;
-      pollFD[1].fd = theReadFD;
-      pollFD[1].events = POLLIN;
-    }
+  if( PopEvent( aEvent ) )
+    return EventPresent;
 
-    poll( pollFD, maxFD, aMaxWaitTime );
+  pollfd pollFD;
+  pollFD.fd = theReadFD;
+  pollFD.events = POLLIN;
+  pollFD.revents = 0;
 
-    if( theReadFD >= 0 && ( pollFD[1].revents & POLLIN ) )
-    {
-      if( ReadFromFD( aEvent ) == EventPresent )
+  if( aMaxWaitTime == NO_WAIT )
+  {
+    // a scheduler runs us because the descriptor became readable, Run
+    // asks at the end of every batch and waits with the descriptor anyway
+    if( theReadFD >= 0 && IsScheduled() && poll( &pollFD, 1, 0 ) > 0 && ( pollFD.revents & POLLIN ) )
+      if( ReadFromFD( aEvent, NO_WAIT ) == EventPresent )
         return EventPresent;
-    }
-
-    if( !( pollFD[0].revents & POLLIN ) )
-      return EventTimeout;
-  }
 
-  boost::lock_guard<boost::mutex> guard( theLock );
-
-  if( theEventQueue.empty() )
     return EventError;
+  }
 
-  aEvent = theEventQueue.front();
-  theEventQueue.pop_front();
+  WaitForEvents( aMaxWaitTime, &pollFD, theReadFD >= 0 ? 1 : 0 );
 
-  char ch = 'Z';
-  if( 1 != read( thePipeFDs[0], &ch, 1 ) )
+  if( theReadFD >= 0 && ( pollFD.revents & POLLIN ) )
   {
-    DBGOUT_FATAL( Debug::Prefix() << "Could not read from event pipe\n" );
-    throw std::runtime_error( "EventProcessor: Could not read from event pipe" );
+    if( ReadFromFD( aEvent ) == EventPresent )
+      return EventPresent;
   }
 
+  if( !PopEvent( aEvent ) )
+    return EventTimeout;
+
   return EventPresent;
 } //}}}
 
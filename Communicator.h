@@ -29,6 +29,7 @@ public:
 
   void SetFD( int FD ) { theReadFD = FD; }
   int GetFD() const { return theReadFD; }
+  virtual int GetPollFD() const { return theReadFD; }
 protected:
 
 
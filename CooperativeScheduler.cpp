@@ -0,0 +1,355 @@
+/*! {{{ File head comment
+  \file CooperativeScheduler.cpp
+
+  \brief
+
+  }}} */
+
+#include <boost/atomic.hpp>
+#include <boost/thread/locks.hpp>
+
+#include <stdexcept>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "CooperativeScheduler.h"
+#include "Clock.h"
+#include "Debug.h"
+
+namespace Event
+{
+
+namespace
+{
+//! scheduler whose Run executes on the calling thread, its ready list needs no lock
+__thread CooperativeScheduler* theRunningScheduler = 0;
+
+#if defined( __GLIBC__ ) && ( __GLIBC__ > 2 || ( __GLIBC__ == 2 && __GLIBC_MINOR__ >= 35 ) )
+#define COOPERATIVE_HAS_PWAIT2
+//! cleared once the kernel (before 5.11) rejects epoll_pwait2
+boost::atomic<bool> theHasPWait2( true );
+#endif
+
+//! \brief epoll_wait with a timeout in microseconds, -1 blocks
+//! without epoll_pwait2 the timeout is rounded up to milliseconds
+int EpollWait( int aEpollFD, epoll_event * aEvents, int aMaxEvents, long long aTimeout ) //{{{
+{
+#ifdef COOPERATIVE_HAS_PWAIT2
+  if( theHasPWait2.load( boost::memory_order_relaxed ) )
+  {
+    timespec timeout;
+    timeout.tv_sec = aTimeout / 1000000;
+    timeout.tv_nsec = ( aTimeout % 1000000 ) * 1000;
+
+    int count = epoll_pwait2( aEpollFD, aEvents, aMaxEvents, aTimeout < 0 ? 0 : &timeout, 0 );
+    if( count >= 0 || errno != ENOSYS )
+      return count;
+
+    theHasPWait2.store( false, boost::memory_order_relaxed );
+  }
+#endif
+
+  return epoll_wait( aEpollFD, aEvents, aMaxEvents, aTimeout < 0 ? -1 : static_cast<int>( ( aTimeout + 999 ) / 1000 ) );
+} //}}}
+}
+
+CooperativeScheduler::CooperativeScheduler() //{{{
+  : ProcessorScheduler( "CooperativeScheduler" ), theEpollFD( -1 ), theWakeupFD( -1 ), theFDCount( 0 ), theSleeping( false )
+{
+  DEBUG_TRACER;
+
+  theEpollFD = epoll_create1( EPOLL_CLOEXEC );
+  if( -1 == theEpollFD )
+  {
+    DBGOUT_FATAL( Debug::Prefix() << "Could not create epoll descriptor\n" );
+    throw std::runtime_error( "CooperativeScheduler: Could not create epoll descriptor" );
+  }
+
+  theWakeupFD = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = 0;
+
+  if( -1 == theWakeupFD || -1 == epoll_ctl( theEpollFD, EPOLL_CTL_ADD, theWakeupFD, &event ) )
+  {
+    if( -1 != theWakeupFD )
+      close( theWakeupFD );
+    close( theEpollFD );
+
+    DBGOUT_FATAL( Debug::Prefix() << "Could not create scheduler wakeup descriptor\n" );
+    throw std::runtime_error( "CooperativeScheduler: Could not create scheduler wakeup descriptor" );
+  }
+} //}}}
+
+CooperativeScheduler::~CooperativeScheduler() //{{{
+{
+  DEBUG_TRACER;
+
+  // processors that were never finished go back to their own wakeup descriptor
+  for( Entries::iterator it = theEntries.begin(); it != theEntries.end(); ++it )
+    Unbind( *it->first );
+
+  close( theWakeupFD );
+  close( theEpollFD );
+} //}}}
+
+void CooperativeScheduler::Attach( EventProcessor & aProcessor ) //{{{
+{
+  DEBUG_TRACER;
+
+  Entry & entry = theEntries[&aProcessor];
+  entry.theFD = aProcessor.GetPollFD();
+
+  if( entry.theFD >= 0 )
+  {
+    ArmFD( entry, aProcessor, EPOLL_CTL_ADD );
+    ++theFDCount;
+  }
+
+  // the first slice picks up whatever was queued before
+  Bind( aProcessor );
+  Schedule( aProcessor );
+} //}}}
+
+void CooperativeScheduler::Run() //{{{
+{
+  DEBUG_TRACER;
+
+  theRunningScheduler = this;
+
+  while( !theEntries.empty() )
+  {
+    TakeIncoming();
+    FireTimers();
+
+    if( theReady.empty() )
+    {
+      Wait( true );
+      continue;
+    }
+
+    // one pass over the processors ready now, those made ready meanwhile go to the next one
+    for( std::size_t count = theReady.size(); count; --count )
+    {
+      EventProcessor* processor = theReady.front();
+      theReady.pop_front();
+      RunProcessor( *processor );
+    }
+
+    if( theFDCount )
+      Wait( false );
+  }
+
+  theRunningScheduler = 0;
+} //}}}
+
+void CooperativeScheduler::Schedule( EventProcessor & aProcessor ) //{{{
+{
+  if( theRunningScheduler == this )
+  {
+    theReady.push_back( &aProcessor );
+    return;
+  }
+
+  {
+    boost::lock_guard<boost::mutex> guard( theIncomingLock );
+    theIncoming.push_back( &aProcessor );
+  }
+
+  if( theSleeping.exchange( false ) )
+  {
+    uint64_t one = 1;
+    if( sizeof( one ) != write( theWakeupFD, &one, sizeof( one ) ) )
+    {
+      DBGOUT_FATAL( Debug::Prefix() << "Could not write to scheduler wakeup descriptor\n" );
+      throw std::runtime_error( "CooperativeScheduler: Could not write to scheduler wakeup descriptor" );
+    }
+  }
+} //}}}
+
+void CooperativeScheduler::RunProcessor( EventProcessor & aProcessor ) //{{{
+{
+  if( !RunSlice( aProcessor ) )
+  {
+    Finish( aProcessor );
+    return;
+  }
+
+  Entry & entry = theEntries[&aProcessor];
+  if( entry.theFD >= 0 && !entry.theFDArmed )
+    ArmFD( entry, aProcessor, EPOLL_CTL_MOD );
+
+  std::pair<bool,TimerWheel::Tick> expiry = GetNextExpiry( aProcessor );
+
+  // a due timer is just more work, the slice may have taken until its deadline
+  if( expiry.first && expiry.second <= Now() )
+  {
+    if( Suspend( aProcessor ) )
+      Wake( aProcessor );
+    else
+      Schedule( aProcessor );
+    return;
+  }
+
+  // the deadline stays on the grid of the processor's timers, no wait is added to a later clock read
+  if( expiry.first )
+    StartTimer( aProcessor, expiry.second );
+
+  if( !Suspend( aProcessor ) )
+    Schedule( aProcessor );
+} //}}}
+
+void CooperativeScheduler::StartTimer( EventProcessor & aProcessor, TimerWheel::Tick aDeadline ) //{{{
+{
+  Entry & entry = theEntries[&aProcessor];
+
+  if( aDeadline == entry.theDeadline )
+    return;
+
+  TimerEntry timer;
+  timer.theDeadline = aDeadline;
+  timer.theProcessor = &aProcessor;
+  timer.theGeneration = ++entry.theGeneration;
+
+  entry.theDeadline = aDeadline;
+  theTimers.push( timer );
+} //}}}
+
+void CooperativeScheduler::Finish( EventProcessor & aProcessor ) //{{{
+{
+  Entries::iterator it = theEntries.find( &aProcessor );
+  Assert( it != theEntries.end() );
+
+  if( it->second.theFD >= 0 )
+  {
+    epoll_ctl( theEpollFD, EPOLL_CTL_DEL, it->second.theFD, 0 );
+    --theFDCount;
+  }
+
+  // stale timers of the processor are recognized by the missing entry
+  theEntries.erase( it );
+
+  Unbind( aProcessor );
+} //}}}
+
+void CooperativeScheduler::ArmFD( Entry & aEntry, EventProcessor & aProcessor, int aOperation ) //{{{
+{
+  // one shot: a readable descriptor wakes the processor once, not on every wait until it is read
+  epoll_event event;
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.ptr = &aProcessor;
+
+  if( -1 == epoll_ctl( theEpollFD, aOperation, aEntry.theFD, &event ) )
+  {
+    DBGOUT_FATAL( Debug::Prefix() << "Could not watch descriptor " << aEntry.theFD << " of processor " << aProcessor.GetID() << "\n" );
+    throw std::runtime_error( "CooperativeScheduler: Could not watch processor descriptor" );
+  }
+
+  aEntry.theFDArmed = true;
+} //}}}
+
+void CooperativeScheduler::TakeIncoming() //{{{
+{
+  std::vector< EventProcessor* > incoming;
+
+  {
+    boost::lock_guard<boost::mutex> guard( theIncomingLock );
+    incoming.swap( theIncoming );
+  }
+
+  theReady.insert( theReady.end(), incoming.begin(), incoming.end() );
+} //}}}
+
+void CooperativeScheduler::FireTimers() //{{{
+{
+  if( theTimers.empty() )
+    return;
+
+  TimerWheel::Tick now = Now();
+
+  while( !theTimers.empty() && theTimers.top().theDeadline <= now )
+  {
+    TimerEntry timer = theTimers.top();
+    theTimers.pop();
+
+    Entries::iterator it = theEntries.find( timer.theProcessor );
+    if( it != theEntries.end() && it->second.theGeneration == timer.theGeneration )
+    {
+      it->second.theDeadline = 0;
+      Wake( *timer.theProcessor );
+    }
+  }
+} //}}}
+
+void CooperativeScheduler::Wait( bool aBlock ) //{{{
+{
+  long long timeout = 0;
+
+  if( aBlock )
+  {
+    if( !theTimers.empty() )
+    {
+      TimerWheel::Tick now = Now();
+      timeout = theTimers.top().theDeadline > now ? theTimers.top().theDeadline - now : 0;
+    }
+    else
+      timeout = -1;
+
+    // pairs with Schedule: either it sees us sleeping or we see its processor
+    theSleeping.store( true );
+
+    boost::lock_guard<boost::mutex> guard( theIncomingLock );
+    if( !theIncoming.empty() )
+      timeout = 0;
+  }
+
+  enum { MAX_EVENTS = 64 };
+  epoll_event events[MAX_EVENTS];
+
+  int count = EpollWait( theEpollFD, events, MAX_EVENTS, timeout );
+  theSleeping.store( false );
+
+  if( -1 == count && errno != EINTR )
+  {
+    DBGOUT_FATAL( Debug::Prefix() << "Error in epoll_wait\n" );
+    throw std::runtime_error( "CooperativeScheduler: Error in epoll_wait" );
+  }
+
+  for( int i = 0; i < count; ++i )
+  {
+    EventProcessor* processor = static_cast<EventProcessor*>( events[i].data.ptr );
+
+    if( !processor )
+    {
+      uint64_t value;
+      while( sizeof( value ) == read( theWakeupFD, &value, sizeof( value ) ) )
+        ;
+      continue;
+    }
+
+    Entries::iterator it = theEntries.find( processor );
+    if( it != theEntries.end() )
+    {
+      it->second.theFDArmed = false;
+      Wake( *processor );
+    }
+  }
+} //}}}
+
+TimerWheel::Tick CooperativeScheduler::Now() //{{{
+{
+  // the clock of the processor timers, their deadlines are read from it
+  return Clock::Microseconds();
+} //}}}
+
+} // end namespace Event
+
+/* {{{ Modeline for ViM
+ * vim600:fdm=marker fdl=0 fdc=3:
+ * }}} */
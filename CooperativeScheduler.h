@@ -0,0 +1,101 @@
+/*! {{{
+  \file CooperativeScheduler.h
+
+  \brief
+
+  }}} */
+
+#ifndef COOPERATIVESCHEDULER_H
+#define COOPERATIVESCHEDULER_H
+
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <deque>
+#include <queue>
+#include <vector>
+
+#include "Event.h"
+
+namespace Event
+{
+
+//! \brief runs EventProcessors run-to-completion on a single thread
+//!
+//! The thread calling Run takes the ready processors round robin, one slice
+//! (a batch of events and the expired timers) each. When none is ready it
+//! sleeps in a single epoll_pwait2 that covers the next timer of all processors,
+//! the descriptors of processors with a GetPollFD and events sent from other
+//! threads. OnEvent of all attached processors is therefore never concurrent.
+//! Like the workers of an Executor the thread never waits for room in a full
+//! OverflowBlock mailbox, such events are dropped.
+class CooperativeScheduler : public ProcessorScheduler, private boost::noncopyable //{{{
+{
+public:
+  CooperativeScheduler();
+  virtual ~CooperativeScheduler();
+
+  //! \brief run aProcessor from now on, before Run or from within an OnEvent
+  //! GetPollFD of aProcessor is read here, it must not change while attached
+  void Attach( EventProcessor & aProcessor );
+
+  //! \brief dispatch events until every attached processor got EVENT_FINISH
+  void Run();
+
+protected:
+  virtual void Schedule( EventProcessor & aProcessor );
+
+private:
+  struct Entry //{{{
+  {
+    Entry() : theGeneration( 0 ), theDeadline( 0 ), theFD( -1 ), theFDArmed( false ) {}
+
+    unsigned long theGeneration; //!< of the latest timer, older heap entries are stale
+    TimerWheel::Tick theDeadline; //!< of the latest timer, 0 if it fired
+    int theFD;
+    bool theFDArmed;
+  }; //}}}
+
+  struct TimerEntry //{{{
+  {
+    TimerWheel::Tick theDeadline; //!< microseconds, Clock
+    EventProcessor* theProcessor;
+    unsigned long theGeneration;
+
+    bool operator<( const TimerEntry & other ) const { return theDeadline > other.theDeadline; }
+  }; //}}}
+
+  typedef boost::unordered_map< EventProcessor*, Entry > Entries;
+
+  void RunProcessor( EventProcessor & aProcessor );
+  void StartTimer( EventProcessor & aProcessor, TimerWheel::Tick aDeadline );
+  void Finish( EventProcessor & aProcessor );
+  void ArmFD( Entry & aEntry, EventProcessor & aProcessor, int aOperation );
+
+  void TakeIncoming();
+  void FireTimers();
+  void Wait( bool aBlock );
+
+  static TimerWheel::Tick Now();
+
+  int theEpollFD;
+  int theWakeupFD;
+
+  std::deque< EventProcessor* > theReady;
+  Entries theEntries;
+  std::priority_queue< TimerEntry > theTimers;
+  unsigned int theFDCount;
+
+  //! processors made ready by other threads
+  std::vector< EventProcessor* > theIncoming;
+  boost::mutex theIncomingLock;
+  boost::atomic<bool> theSleeping;
+}; //}}}
+
+}
+
+#endif /* ifndef COOPERATIVESCHEDULER_H */
+
+/* {{{ Modeline for ViM
+ * vim600:fdm=marker fdl=0 fdc=3:
+ * }}} */
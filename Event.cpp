@@ -8,6 +8,7 @@
 #include <boost/lambda/lambda.hpp>
 #include <boost/lambda/bind.hpp>
 #include <boost/thread/locks.hpp>
+#include <boost/unordered_map.hpp>
 
 #include <loki/Singleton.h>
 
@@ -18,8 +19,16 @@
 #include <utility>
 
 #include <sys/poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "Event.h"
+#include "Clock.h"
+#include "SimulatedClock.h"
+#include "Snapshot.h"
 
 using namespace boost::posix_time;
 using namespace boost::lambda;
@@ -27,61 +36,331 @@ using namespace boost::lambda;
 namespace Event
 {
 
+namespace
+{
+
+//! processor whose events the calling thread dispatches, only ever read by that thread
+__thread EventProcessor* theDispatching = 0;
+
+}
+
 class EventProcessorCollection //{{{
 {
 public:
+  EventProcessorCollection() : theRegistry( new Registry ), theChanged( false ) {}
+
   void RegisterProcessor( EventProcessor* aProcessor );
   void UnRegisterProcessor( EventProcessor* aProcessor );
 
+  void Subscribe( EventProcessor* aProcessor, unsigned int aFirstID, unsigned int aLastID );
+
   void Broadcast( const EventPointer & aEvent );
 
+  //! \return false if no processor has aProcessorID
+  template<typename P> bool SendTo( unsigned int aProcessorID, P && aEvent );
+
+  SendResult TrySendTo( unsigned int aProcessorID, const EventPointer & aEvent );
+
 private:
+  //! ranges up to this size are expanded into the ID index
+  enum { RANGE_EXPAND_LIMIT = 1024 };
 
   typedef std::vector<EventProcessor*> ProcessorStorage;
-  ProcessorStorage theProcessors;
+  typedef boost::unordered_map< unsigned int, ProcessorStorage > SubscriberIndex;
+
+  struct RangeSubscription
+  {
+    unsigned int theFirstID;
+    unsigned int theLastID;
+    EventProcessor* theProcessor;
+  };
+  typedef std::vector<RangeSubscription> RangeStorage;
+
+  typedef boost::unordered_map< unsigned int, EventProcessor* > ProcessorIndex;
+
+  //! never changed once published, see thePending
+  struct Registry
+  {
+    ProcessorStorage theProcessors;
+    ProcessorIndex theProcessorsByID;
 
+    //! processors without subscriptions, filtered with IsEventOfInteres
+    ProcessorStorage theUnsubscribed;
+
+    SubscriberIndex theSubscribers;
+    RangeStorage theRanges;
+  };
+
+  //! \brief publish a copy of thePending if writers changed it since the last one
+  void PublishChanges();
+
+  //! \brief push without waiting for a full OverflowBlock mailbox, aProcessor is pinned and added to aFull then
+  static void Deliver( EventProcessor* aProcessor, const EventPointer & aEvent, ProcessorStorage & aFull );
+  static void DeliverBlocking( const ProcessorStorage & aFull, const EventPointer & aEvent );
+
+  SnapshotHolder< Registry > theRegistry;
+
+  //! the registry the writers change in place, the next reader publishes it
+  //! so setting up many processors and subscriptions copies it once
+  Registry thePending;
+  boost::atomic<bool> theChanged;
+
+  //! serializes writers and publishing, Broadcast takes it only after changes
   boost::mutex theLock;
 }; //}}}
 
+void EventProcessorCollection::PublishChanges() //{{{
+{
+  boost::lock_guard<boost::mutex> guard( theLock );
+
+  if( !theChanged.load() )
+    return;
+
+  theRegistry.Publish( new Registry( thePending ) );
+  theChanged.store( false );
+} //}}}
+
 void EventProcessorCollection::RegisterProcessor( EventProcessor* aProcessor ) //{{{
 {
   DEBUG_TRACER;
   boost::lock_guard<boost::mutex> guard( theLock );
 
-  ProcessorStorage::const_iterator it = std::find( theProcessors.begin(), theProcessors.end(), aProcessor );
-  if( it != theProcessors.end() )
+  ProcessorIndex::const_iterator it = thePending.theProcessorsByID.find( aProcessor->GetID() );
+  if( it != thePending.theProcessorsByID.end() )
   {
-    DBGOUT_FATAL( Debug::Prefix() << "Error in RegisterProcessor\n" );
-    throw std::runtime_error( "RegisterProcessor: object already present" );
+    if( it->second == aProcessor )
+    {
+      DBGOUT_FATAL( Debug::Prefix() << "Error in RegisterProcessor\n" );
+      throw std::runtime_error( "RegisterProcessor: object already present" );
+    }
+
+    DBGOUT_FATAL( Debug::Prefix() << "Error in RegisterProcessor, id " << aProcessor->GetID() << " is used\n" );
+    throw std::runtime_error( "RegisterProcessor: processor id already present" );
   }
 
-  theProcessors.push_back( aProcessor );
+  thePending.theProcessors.push_back( aProcessor );
+  thePending.theProcessorsByID[aProcessor->GetID()] = aProcessor;
+  thePending.theUnsubscribed.push_back( aProcessor );
+
+  theChanged.store( true );
 } //}}}
 
 void EventProcessorCollection::UnRegisterProcessor( EventProcessor* aProcessor ) //{{{
+{
+  DEBUG_TRACER;
+
+  {
+    boost::lock_guard<boost::mutex> guard( theLock );
+
+    ProcessorStorage & processors = thePending.theProcessors;
+    ProcessorStorage::iterator it = std::find( processors.begin(), processors.end(), aProcessor );
+    if( it == processors.end() )
+    {
+      DBGOUT_FATAL( Debug::Prefix() << "Error in UnRegisterProcessor\n" );
+      throw std::runtime_error( "RegisterProcessor: object not found" );
+    }
+
+    processors.erase( it );
+    thePending.theProcessorsByID.erase( aProcessor->GetID() );
+
+    ProcessorStorage & unsubscribed = thePending.theUnsubscribed;
+    unsubscribed.erase( std::remove( unsubscribed.begin(), unsubscribed.end(), aProcessor ), unsubscribed.end() );
+
+    for( SubscriberIndex::iterator sit = thePending.theSubscribers.begin(); sit != thePending.theSubscribers.end(); )
+    {
+      ProcessorStorage & subscribers = sit->second;
+      subscribers.erase( std::remove( subscribers.begin(), subscribers.end(), aProcessor ), subscribers.end() );
+
+      if( subscribers.empty() )
+        sit = thePending.theSubscribers.erase( sit );
+      else
+        ++sit;
+    }
+
+    RangeStorage & ranges = thePending.theRanges;
+    ranges.erase( std::remove_if( ranges.begin(), ranges.end(),
+      bind( &RangeSubscription::theProcessor, boost::lambda::_1 ) == aProcessor ), ranges.end() );
+
+    // at once, the processor is about to go
+    theRegistry.Publish( new Registry( thePending ) );
+    theChanged.store( false );
+  }
+
+  // outside theLock: the readers still to wait for may publish changes themselves
+  theRegistry.Synchronize();
+
+  // no Broadcast finds aProcessor any more, the ones waiting for room in its mailbox give up
+  aProcessor->Close();
+} //}}}
+
+void EventProcessorCollection::Subscribe( EventProcessor* aProcessor, unsigned int aFirstID, unsigned int aLastID ) //{{{
 {
   DEBUG_TRACER;
   boost::lock_guard<boost::mutex> guard( theLock );
 
-  ProcessorStorage::iterator it = std::find( theProcessors.begin(), theProcessors.end(), aProcessor );
-  if( it == theProcessors.end() )
+  Assert( aFirstID <= aLastID );
+
+  // a processor usually subscribes right after it registered, look from the back
+  ProcessorStorage & unsubscribed = thePending.theUnsubscribed;
+  ProcessorStorage::reverse_iterator uit = std::find( unsubscribed.rbegin(), unsubscribed.rend(), aProcessor );
+  if( uit != unsubscribed.rend() )
+    unsubscribed.erase( --uit.base() );
+
+  if( aLastID - aFirstID >= RANGE_EXPAND_LIMIT )
   {
-    DBGOUT_FATAL( Debug::Prefix() << "Error in UnRegisterProcessor\n" );
-    throw std::runtime_error( "RegisterProcessor: object not found" );
+    RangeSubscription range = { aFirstID, aLastID, aProcessor };
+
+    // the ranges of a processor never overlap, Broadcast would deliver twice
+    RangeStorage & ranges = thePending.theRanges;
+    for( RangeStorage::iterator it = ranges.begin(); it != ranges.end(); )
+    {
+      if( it->theProcessor == aProcessor && it->theFirstID <= range.theLastID && range.theFirstID <= it->theLastID )
+      {
+        range.theFirstID = std::min( range.theFirstID, it->theFirstID );
+        range.theLastID = std::max( range.theLastID, it->theLastID );
+        it = ranges.erase( it );
+      }
+      else
+        ++it;
+    }
+
+    ranges.push_back( range );
   }
+  else
+  {
+    for( unsigned long id = aFirstID; id <= aLastID; ++id )
+    {
+      ProcessorStorage & subscribers = thePending.theSubscribers[id];
+      if( std::find( subscribers.begin(), subscribers.end(), aProcessor ) == subscribers.end() )
+        subscribers.push_back( aProcessor );
+    }
+  }
+
+  theChanged.store( true );
+} //}}}
+
+void EventProcessorCollection::Deliver( EventProcessor* aProcessor, const EventPointer & aEvent, ProcessorStorage & aFull ) //{{{
+{
+  if( aProcessor->TryPushEvent( aEvent ) != EventProcessor::PushFull )
+    return;
 
-  theProcessors.erase( it );
+  // keeps aProcessor alive once the ReadGuard is gone, see EventProcessor::Close
+  aProcessor->Pin();
+  aFull.push_back( aProcessor );
+} //}}}
+
+void EventProcessorCollection::DeliverBlocking( const ProcessorStorage & aFull, const EventPointer & aEvent ) //{{{
+{
+  for( ProcessorStorage::const_iterator it = aFull.begin(); it != aFull.end(); ++ it )
+  {
+    (*it)->PushEvent( aEvent );
+    (*it)->Unpin();
+  }
 } //}}}
 
 void EventProcessorCollection::Broadcast( const EventPointer & aEvent ) //{{{
 {
   DEBUG_TRACER;
-  boost::lock_guard<boost::mutex> guard( theLock );
 
-  for( ProcessorStorage::iterator it = theProcessors.begin(); it != theProcessors.end(); ++ it )
+  if( theChanged.load() )
+    PublishChanges();
+
+  // processors with a full OverflowBlock mailbox, waited for once the ReadGuard is gone,
+  // a Broadcast waiting with it would hold up UnRegisterProcessor
+  ProcessorStorage full;
+
+  {
+    SnapshotHolder< Registry >::ReadGuard registry( theRegistry );
+
+    if( EventProcessor::IsSystemEvent( aEvent ) )
+    {
+      for( ProcessorStorage::const_iterator it = registry->theProcessors.begin(); it != registry->theProcessors.end(); ++ it )
+        Deliver( *it, aEvent, full );
+    }
+    else
+    {
+      SubscriberIndex::const_iterator sit = registry->theSubscribers.find( aEvent->ID() );
+      const ProcessorStorage* subscribers = sit != registry->theSubscribers.end() ? &sit->second : 0;
+
+      if( subscribers )
+      {
+        for( ProcessorStorage::const_iterator it = subscribers->begin(); it != subscribers->end(); ++ it )
+          Deliver( *it, aEvent, full );
+      }
+
+      for( RangeStorage::const_iterator it = registry->theRanges.begin(); it != registry->theRanges.end(); ++ it )
+      {
+        if( aEvent->ID() < it->theFirstID || aEvent->ID() > it->theLastID )
+          continue;
+
+        // already reached through the ID index
+        if( subscribers && std::find( subscribers->begin(), subscribers->end(), it->theProcessor ) != subscribers->end() )
+          continue;
+
+        Deliver( it->theProcessor, aEvent, full );
+      }
+
+      for( ProcessorStorage::const_iterator it = registry->theUnsubscribed.begin(); it != registry->theUnsubscribed.end(); ++ it )
+      {
+        if( (*it)->IsEventOfInteres( aEvent ) )
+          Deliver( *it, aEvent, full );
+      }
+    }
+  }
+
+  DeliverBlocking( full, aEvent );
+} //}}}
+
+template<typename P>
+bool EventProcessorCollection::SendTo( unsigned int aProcessorID, P && aEvent ) //{{{
+{
+  DEBUG_TRACER;
+
+  if( theChanged.load() )
+    PublishChanges();
+
+  EventProcessor* full = 0;
+
+  {
+    SnapshotHolder< Registry >::ReadGuard registry( theRegistry );
+
+    ProcessorIndex::const_iterator it = registry->theProcessorsByID.find( aProcessorID );
+    if( it == registry->theProcessorsByID.end() )
+      return false;
+
+    // a moved event is left untouched unless it was queued
+    EventProcessor::PushResult result = it->second->TryPushEvent( std::forward<P>( aEvent ) );
+    if( result != EventProcessor::PushFull )
+      return result == EventProcessor::PushQueued;
+
+    full = it->second;
+    full->Pin();
+  }
+
+  bool pushed = full->PushEvent( std::forward<P>( aEvent ) );
+  full->Unpin();
+
+  return pushed;
+} //}}}
+
+SendResult EventProcessorCollection::TrySendTo( unsigned int aProcessorID, const EventPointer & aEvent ) //{{{
+{
+  DEBUG_TRACER;
+
+  if( theChanged.load() )
+    PublishChanges();
+
+  SnapshotHolder< Registry >::ReadGuard registry( theRegistry );
+
+  ProcessorIndex::const_iterator it = registry->theProcessorsByID.find( aProcessorID );
+  if( it == registry->theProcessorsByID.end() )
+    return SendNoProcessor;
+
+  switch( it->second->TryPushEvent( aEvent ) )
   {
-    if( (*it)->IsEventOfInteres( aEvent ) )
-      (*it)->PushEvent( aEvent );
+    case EventProcessor::PushQueued: return SendQueued;
+    case EventProcessor::PushDropped: return SendDropped;
+    default: return SendFull;
   }
 } //}}}
 
@@ -93,73 +372,504 @@ void SendEvent( const EventPointer & aEvent ) //{{{
   ProcessorsSingleton::Instance().Broadcast( aEvent );
 } //}}}
 
-EventProcessor::EventProcessor( unsigned int aID ) //{{{
-  : theID( aID ), theEventQueue( EVENTQ_MAX_SIZE )
+bool SendEventTo( unsigned int aProcessorID, const EventPointer & aEvent ) //{{{
+{
+  return ProcessorsSingleton::Instance().SendTo( aProcessorID, aEvent );
+} //}}}
+
+bool SendEventTo( unsigned int aProcessorID, EventPointer && aEvent ) //{{{
 {
-  if( -1 == pipe( thePipeFDs ) )
+  return ProcessorsSingleton::Instance().SendTo( aProcessorID, std::move( aEvent ) );
+} //}}}
+
+SendResult TrySendEventTo( unsigned int aProcessorID, const EventPointer & aEvent ) //{{{
+{
+  return ProcessorsSingleton::Instance().TrySendTo( aProcessorID, aEvent );
+} //}}}
+
+void EventProcessor::Subscribe( unsigned int aID ) //{{{
+{
+  ProcessorsSingleton::Instance().Subscribe( this, aID, aID );
+} //}}}
+
+void EventProcessor::Subscribe( unsigned int aFirstID, unsigned int aLastID ) //{{{
+{
+  ProcessorsSingleton::Instance().Subscribe( this, aFirstID, aLastID );
+} //}}}
+
+EventProcessor::EventProcessor( unsigned int aID, std::size_t aCapacity /*= EVENTQ_MAX_SIZE*/, OverflowPolicy aPolicy /*= OverflowDropNewest*/ ) //{{{
+  : theID( aID ), theBatchSize( 1 ), theWakeupFD( -1 ), theParked( false ),
+    theOverflowPolicy( aPolicy ), theDequeueMode( DequeueStrict ), theScheduler( 0 ), theRunState( 0 ), theBlockedProducers( 0 ), thePins( 0 ), theClosing( false ), theCoalescedLanes( 0 ),
+    theDropped( 0 ), theCoalescedCount( 0 ), theBlocked( 0 ), theBlockedMicroseconds( 0 )
+{
+  static const unsigned int defaultWeights[PRIORITY_LEVELS] = { 16, 4, 1 };
+
+  for( unsigned int lane = 0; lane < PRIORITY_LEVELS; ++lane )
+  {
+    theEventQueues.push_back( new Mailbox< EventPointer >( aCapacity ) );
+    theLaneWeights[lane] = theLaneCredits[lane] = defaultWeights[lane];
+  }
+
+  theWakeupFD = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  if( -1 == theWakeupFD )
   {
-    DBGOUT_FATAL( Debug::Prefix() << "Could not create event pipe\n" );
-    throw std::runtime_error( "EventProcessor: Could not create event pipe" );
+    DBGOUT_FATAL( Debug::Prefix() << "Could not create event wakeup descriptor\n" );
+    throw std::runtime_error( "EventProcessor: Could not create event wakeup descriptor" );
   }
 
-  ProcessorsSingleton::Instance().RegisterProcessor( this );
+  try
+  {
+    ProcessorsSingleton::Instance().RegisterProcessor( this );
+  }
+  catch( ... )
+  {
+    close( theWakeupFD );
+    throw;
+  }
 }//}}}
 
 EventProcessor::~EventProcessor() //{{{
 {
   ProcessorsSingleton::Instance().UnRegisterProcessor( this );
+
+  close( theWakeupFD );
 } //}}}
 
-void EventProcessor::PushEvent( const EventPointer & aEvent ) //{{{
+bool EventProcessor::PushEvent( const EventPointer & aEvent ) //{{{
 {
   DEBUG_TRACER;
-  boost::lock_guard<boost::mutex> guard( theLock );
+  return Enqueue( aEvent, true ) == PushQueued;
+} //}}}
 
-  Assert( !theEventQueue.full() );
+bool EventProcessor::PushEvent( EventPointer && aEvent ) //{{{
+{
+  DEBUG_TRACER;
+  return Enqueue( std::move( aEvent ), true ) == PushQueued;
+} //}}}
 
-  theEventQueue.push_back( aEvent );
+template<typename P>
+EventProcessor::PushResult EventProcessor::TryPushEvent( P && aEvent ) //{{{
+{
+  return Enqueue( std::forward<P>( aEvent ), false );
+} //}}}
+
+template<typename P>
+EventProcessor::PushResult EventProcessor::Enqueue( P && aEvent, bool aMayBlock ) //{{{
+{
+  unsigned int lane = LaneOf( aEvent );
 
-  char ch = 'A';
-  if( 1 != write( thePipeFDs[1], &ch, 1 ) )
+  // while coalesced events of the lane wait, newer events of the lane queue behind them
+  bool coalescing = ( theCoalescedLanes.load( boost::memory_order_acquire ) & ( 1U << lane ) ) && IsCoalescable( aEvent, lane );
+
+  // a moved event is left untouched if the mailbox is full
+  if( coalescing || !theEventQueues[lane].Push( std::forward<P>( aEvent ) ) )
   {
-    DBGOUT_FATAL( Debug::Prefix() << "Could not write to event pipe\n" );
-    throw std::runtime_error( "EventProcessor: Could not write to event pipe" );
+    if( !aMayBlock && theOverflowPolicy == OverflowBlock )
+      return PushFull;
+
+    if( !HandleOverflow( aEvent, lane ) )
+      return PushDropped;
   }
+
+  WakeConsumer();
+  return PushQueued;
 } //}}}
 
-EventProcessor::EventResult EventProcessor::GetEvent( EventPointer & aEvent, long aMaxWaitTime /*= WAIT_FOREWER*/ ) //{{{
+void EventProcessor::WakeConsumer() //{{{
+{
+  // pairs with the fence in WaitForEvents: either the consumer sees the
+  // event before it sleeps, or we see it parked and wake it
+  boost::atomic_thread_fence( boost::memory_order_seq_cst );
+
+  ProcessorScheduler* scheduler = theScheduler.load( boost::memory_order_acquire );
+  if( scheduler )
+  {
+    scheduler->Wake( *this );
+    return;
+  }
+
+  // virtual time must not move on while the event waits, parked or not
+  if( Clock::GetSource() == Clock::SourceSimulated )
+    SimulatedClock::Wake( theWakeupFD );
+
+  if( !theParked.load( boost::memory_order_relaxed ) || !theParked.exchange( false ) )
+    return;
+
+  uint64_t one = 1;
+  if( sizeof( one ) != write( theWakeupFD, &one, sizeof( one ) ) )
+  {
+    DBGOUT_FATAL( Debug::Prefix() << "Could not write to event wakeup descriptor\n" );
+    throw std::runtime_error( "EventProcessor: Could not write to event wakeup descriptor" );
+  }
+} //}}}
+
+bool EventProcessor::HandleOverflow( const EventPointer & aEvent, unsigned int aLane ) //{{{
+{
+  Mailbox< EventPointer > & queue = theEventQueues[aLane];
+
+  // no policy loses a control event, EVENT_FINISH among them, it takes the room of the oldest user event
+  if( IsSystemEvent( aEvent ) )
+    return PushDroppingOldest( aEvent, queue );
+
+  switch( theOverflowPolicy )
+  {
+    case OverflowBlock:
+      return PushBlocking( aEvent, queue );
+
+    case OverflowDropNewest:
+      ++theDropped;
+      return false;
+
+    case OverflowDropOldest:
+      return PushDroppingOldest( aEvent, queue );
+
+    case OverflowCoalesce:
+      break;
+  }
+
+  // parked events would wait behind the bulk of the lane
+  if( !IsCoalescable( aEvent, aLane ) )
+    return PushDroppingOldest( aEvent, queue );
+
+  boost::lock_guard<boost::mutex> guard( theCoalesceLock );
+
+  std::vector< EventPointer > & coalesced = theCoalesced[aLane];
+  for( std::vector< EventPointer >::iterator it = coalesced.begin(); it != coalesced.end(); ++it )
+  {
+    if( (*it)->ID() == aEvent->ID() )
+    {
+      *it = aEvent;
+      ++theCoalescedCount;
+      return true;
+    }
+  }
+
+  coalesced.push_back( aEvent );
+  theCoalescedLanes.fetch_or( 1U << aLane, boost::memory_order_release );
+
+  return true;
+} //}}}
+
+bool EventProcessor::PushDroppingOldest( const EventPointer & aEvent, Mailbox< EventPointer > & aQueue ) //{{{
+{
+  // control events taken out lose their place and queue again behind aEvent
+  std::vector< EventPointer > pending( 1, aEvent );
+  std::size_t next = 0;
+
+  // control events taken out since the last user event was dropped
+  std::size_t controlOnly = 0;
+
+  EventPointer oldest;
+  while( next < pending.size() && controlOnly <= aQueue.Capacity() )
+  {
+    if( aQueue.Push( pending[next] ) )
+    {
+      ++next;
+      continue;
+    }
+
+    if( !aQueue.Pop( oldest ) )
+      continue;
+
+    if( IsSystemEvent( oldest ) )
+    {
+      pending.push_back( oldest );
+      ++controlOnly;
+    }
+    else
+    {
+      ++theDropped;
+      controlOnly = 0;
+    }
+  }
+
+  // the lane holds control events only, nothing is left to make room with
+  bool pushed = next > 0;
+  for( ; next < pending.size(); ++next )
+    if( PushBlocking( pending[next], aQueue ) && next == 0 )
+      pushed = true;
+
+  return pushed;
+} //}}}
+
+bool EventProcessor::PushBlocking( const EventPointer & aEvent, Mailbox< EventPointer > & aQueue ) //{{{
+{
+  // the consumer would wait for itself
+  if( theDispatching == this )
+  {
+    DBGOUT_WARNING( Debug::Prefix() << "EventProcessor(" << GetID() << ") queue full, dropped event " << std::hex << aEvent->ID() << std::dec << " sent to itself\n" );
+    ++theDropped;
+    return false;
+  }
+
+  // a scheduler thread would hold up every processor it runs, the consumer possibly among them
+  if( theDispatching && theDispatching->theScheduler.load( boost::memory_order_relaxed ) )
+  {
+    DBGOUT_WARNING( Debug::Prefix() << "EventProcessor(" << GetID() << ") queue full, dropped event " << std::hex << aEvent->ID() << std::dec << " sent from scheduled processor " << theDispatching->GetID() << "\n" );
+    ++theDropped;
+    return false;
+  }
+
+  ++theBlocked;
+
+  timespec start;
+  clock_gettime( CLOCK_MONOTONIC, &start );
+
+  // a short spin catches a consumer that is just draining the lane
+  bool pushed = false;
+  for( unsigned int attempt = 0; attempt < 16 && !pushed; ++attempt )
+  {
+    boost::this_thread::yield();
+    pushed = aQueue.Push( aEvent );
+  }
+
+  if( !pushed )
+  {
+    // pairs with the check in PopEvent: either the consumer sees us waiting
+    // and notifies, or our next Push sees the room it made
+    theBlockedProducers.fetch_add( 1 );
+
+    boost::unique_lock<boost::mutex> lock( theRoomLock );
+    while( !( pushed = aQueue.Push( aEvent ) ) && !theClosing.load() )
+      theRoomCondition.wait( lock );
+
+    theBlockedProducers.fetch_sub( 1 );
+
+    // the processor was unregistered while we waited
+    if( !pushed )
+    {
+      ++theDropped;
+      return false;
+    }
+  }
+
+  timespec end;
+  clock_gettime( CLOCK_MONOTONIC, &end );
+  theBlockedMicroseconds += ( end.tv_sec - start.tv_sec ) * 1000000LL + ( end.tv_nsec - start.tv_nsec ) / 1000;
+
+  return true;
+} //}}}
+
+void EventProcessor::Close() //{{{
+{
+  theClosing.store( true );
+
+  {
+    boost::lock_guard<boost::mutex> guard( theRoomLock );
+    theRoomCondition.notify_all();
+  }
+
+  // the pinned producers just return from PushBlocking
+  while( thePins.load() )
+    boost::this_thread::yield();
+} //}}}
+
+void EventProcessor::FlushCoalesced() //{{{
+{
+  boost::lock_guard<boost::mutex> guard( theCoalesceLock );
+
+  // a full lane only holds back its own parked events
+  for( unsigned int lane = 0; lane < PRIORITY_LEVELS; ++lane )
+  {
+    std::vector< EventPointer > & coalesced = theCoalesced[lane];
+
+    std::vector< EventPointer >::iterator it = coalesced.begin();
+    while( it != coalesced.end() && theEventQueues[lane].Push( *it ) )
+      ++it;
+
+    coalesced.erase( coalesced.begin(), it );
+
+    if( coalesced.empty() )
+      theCoalescedLanes.fetch_and( ~( 1U << lane ), boost::memory_order_release );
+  }
+} //}}}
+
+bool EventProcessor::PopEvent( EventPointer & aEvent ) //{{{
+{
+  if( !PopFromLanes( aEvent ) )
+  {
+    if( !theCoalescedLanes.load( boost::memory_order_acquire ) )
+      return false;
+
+    FlushCoalesced();
+    return PopFromLanes( aEvent );
+  }
+
+  // room was just made for a producer parked in PushBlocking
+  if( theBlockedProducers.load() )
+  {
+    boost::lock_guard<boost::mutex> guard( theRoomLock );
+    theRoomCondition.notify_all();
+  }
+
+  // room was just made, let parked coalesced events back in order
+  if( theCoalescedLanes.load( boost::memory_order_relaxed ) )
+    FlushCoalesced();
+
+  return true;
+} //}}}
+
+bool EventProcessor::PopFromLanes( EventPointer & aEvent ) //{{{
+{
+  if( theDequeueMode == DequeueStrict )
+  {
+    for( unsigned int lane = 0; lane < PRIORITY_LEVELS; ++lane )
+      if( theEventQueues[lane].Pop( aEvent ) )
+        return true;
+
+    return false;
+  }
+
+  for( unsigned int lane = 0; lane < PRIORITY_LEVELS; ++lane )
+  {
+    if( theLaneCredits[lane] && theEventQueues[lane].Pop( aEvent ) )
+    {
+      --theLaneCredits[lane];
+      return true;
+    }
+  }
+
+  // every lane with work has used its share: start the next round
+  for( unsigned int lane = 0; lane < PRIORITY_LEVELS; ++lane )
+    theLaneCredits[lane] = theLaneWeights[lane];
+
+  for( unsigned int lane = 0; lane < PRIORITY_LEVELS; ++lane )
+  {
+    if( theEventQueues[lane].Pop( aEvent ) )
+    {
+      --theLaneCredits[lane];
+      return true;
+    }
+  }
+
+  return false;
+} //}}}
+
+bool EventProcessor::IsQueueEmpty() const //{{{
+{
+  for( unsigned int lane = 0; lane < PRIORITY_LEVELS; ++lane )
+    if( !theEventQueues[lane].Empty() )
+      return false;
+
+  return !theCoalescedLanes.load();
+} //}}}
+
+void EventProcessor::SetLaneWeight( EventPriority aLane, unsigned int aWeight ) //{{{
+{
+  Assert( aLane < PRIORITY_LEVELS );
+
+  theLaneWeights[aLane] = aWeight ? aWeight : 1;
+  theLaneCredits[aLane] = theLaneWeights[aLane];
+} //}}}
+
+EventProcessor::OverflowStatistics EventProcessor::GetOverflowStatistics() const //{{{
+{
+  OverflowStatistics statistics;
+  statistics.theDropped = theDropped.load();
+  statistics.theCoalesced = theCoalescedCount.load();
+  statistics.theBlocked = theBlocked.load();
+  statistics.theBlockedMicroseconds = theBlockedMicroseconds.load();
+
+  return statistics;
+} //}}}
+
+int EventProcessor::WaitForEvents( long aMaxWaitTime, pollfd * aExtraFDs /*= 0*/, unsigned int aExtraCount /*= 0*/ ) //{{{
 {
   DEBUG_TRACER;
 
-  if( aMaxWaitTime != NO_WAIT )
+  enum { MAX_EXTRA_FDS = 4 };
+  Assert( aExtraCount <= MAX_EXTRA_FDS );
+
+  // in virtual time the wait ends when the clock reaches the deadline, the clock writes theWakeupFD
+  bool simulated = Clock::GetSource() == Clock::SourceSimulated;
+  if( simulated )
   {
-    pollfd pollFD;
-    pollFD.fd = thePipeFDs[0];
-    pollFD.events = POLLIN;
+    boost::int64_t deadline = SimulatedClock::NO_DEADLINE;
+    if( aMaxWaitTime >= 0 )
+      deadline = Clock::Microseconds() + aMaxWaitTime;
 
+    while( !SimulatedClock::Idle( theWakeupFD, deadline ) )
+    {
+      if( !IsQueueEmpty() )
+        return 1;
+    }
 
-    poll( &pollFD, 1, aMaxWaitTime );
+    aMaxWaitTime = WAIT_FOREWER;
+  }
 
+  theParked.store( true );
+  boost::atomic_thread_fence( boost::memory_order_seq_cst );
 
-    if( !( pollFD.revents & POLLIN ) )
-      return EventTimeout;
+  if( !IsQueueEmpty() )
+  {
+    theParked.store( false );
+    if( simulated )
+      SimulatedClock::Busy( theWakeupFD );
+    return 1;
   }
 
-  boost::lock_guard<boost::mutex> guard( theLock );
+  pollfd pollFD[2 + MAX_EXTRA_FDS];
+  pollFD[0].fd = theWakeupFD;
+  pollFD[0].events = POLLIN;
+  pollFD[0].revents = 0;
+  for( unsigned int i = 0; i < aExtraCount; ++i )
+    pollFD[i + 1] = aExtraFDs[i];
 
-  if( theEventQueue.empty() )
-    return EventError;
+  unsigned int count = 1 + aExtraCount;
+  if( GetTimerFD() >= 0 )
+  {
+    pollFD[count].fd = GetTimerFD();
+    pollFD[count].events = POLLIN;
+    pollFD[count].revents = 0;
+    ++count;
+  }
 
-  aEvent = theEventQueue.front();
-  theEventQueue.pop_front();
+  // ppoll keeps the microseconds of the timeout, poll would round them to milliseconds
+  timespec timeout;
+  timeout.tv_sec = aMaxWaitTime / 1000000;
+  timeout.tv_nsec = ( aMaxWaitTime % 1000000 ) * 1000;
 
-  char ch = 'Z';
-  if( 1 != read( thePipeFDs[0], &ch, 1 ) )
+  int ready = ppoll( pollFD, count, aMaxWaitTime < 0 ? 0 : &timeout, 0 );
+
+  theParked.store( false );
+  if( simulated )
+    SimulatedClock::Busy( theWakeupFD );
+
+  if( count > 1 + aExtraCount && ( pollFD[count - 1].revents & POLLIN ) )
+    AcknowledgeTimerFD();
+
+  if( pollFD[0].revents & POLLIN )
   {
-    DBGOUT_FATAL( Debug::Prefix() << "Could not read from event pipe\n" );
-    throw std::runtime_error( "EventProcessor: Could not read from event pipe" );
+    // a late or spurious signal only costs one extra wakeup, nothing to check
+    uint64_t count;
+    if( -1 == read( theWakeupFD, &count, sizeof( count ) ) && errno != EAGAIN )
+    {
+      DBGOUT_FATAL( Debug::Prefix() << "Could not read from event wakeup descriptor\n" );
+      throw std::runtime_error( "EventProcessor: Could not read from event wakeup descriptor" );
+    }
   }
 
+  for( unsigned int i = 0; i < aExtraCount; ++i )
+    aExtraFDs[i].revents = pollFD[i + 1].revents;
+
+  return ready;
+} //}}}
+
+EventProcessor::EventResult EventProcessor::GetEvent( EventPointer & aEvent, long aMaxWaitTime /*= WAIT_FOREWER*/ ) //{{{
+{
+  DEBUG_TRACER;
+
+  if( PopEvent( aEvent ) )
+    return EventPresent;
+
+  if( aMaxWaitTime == NO_WAIT )
+    return EventError;
+
+  WaitForEvents( aMaxWaitTime );
+
+  if( !PopEvent( aEvent ) )
+    return EventTimeout;
+
   return EventPresent;
 } //}}}
 
@@ -167,34 +877,120 @@ void EventProcessor::Run() //{{{
 {
   DEBUG_TRACER;
 
+  theDispatching = this;
+
+  bool simulated = Clock::GetSource() == Clock::SourceSimulated;
+  if( simulated )
+    SimulatedClock::Join( theWakeupFD );
+
+  UpdateTime();
+
   long timeToWait = -1;
   while( true )
   {
     EventPointer event;
-    std::pair<bool,long int> needWait = GetMaxWaitTime();
-    if( needWait.first )
-      timeToWait = needWait.second;
+
+    // the dispatch took time since UpdateTime, the wait counts from a fresh read
+    std::pair<bool,TimerWheel::Tick> expiry = GetNextExpiry();
+    if( expiry.first )
+    {
+      TimerWheel::Tick now = Clock::Microseconds();
+      timeToWait = expiry.second > now ? static_cast<long>( expiry.second - now ) : 0L;
+    }
     else
-      timeToWait = -1;
+      timeToWait = WAIT_FOREWER;
 
-    DBGOUT_DEBUG( Debug::Prefix() << "EventProcessor(" << GetID() << ")::Run needWait " << needWait.first << ", " << needWait.second << " timeToWait " << timeToWait << std:: endl );
+    // the timerfd ends the wait at the deadline itself, with the CLOCK_MONOTONIC source only
+    if( GetTimerFD() >= 0 && timeToWait != NO_WAIT && ArmTimerFD() )
+      timeToWait = WAIT_FOREWER;
 
-    if( GetEvent( event, timeToWait ) == EventPresent )
-    {
-      OnEvent( event );
+    DBGOUT_DEBUG( Debug::Prefix() << "EventProcessor(" << GetID() << ")::Run expiry " << expiry.first << ", " << expiry.second << " timeToWait " << timeToWait << std:: endl );
 
-      if( event->ID() == EVENT_FINISH )
-        break;
-    }
+    EventResult result = GetEvent( event, timeToWait );
 
-    std::pair<bool,unsigned char> timer = GetNextTimer();
-    DBGOUT_DEBUG( Debug::Prefix() << "EventProcessor(" << GetID() << ")::Run timer " << timer.first << ", " << static_cast<int>( timer.second ) << std:: endl );
-    if( timer.first )
-    {
-      EventPointer ptr = EventPointer( new Event( TIMER_ELAPSED( timer.second ) ) );
-      OnEvent( ptr );
-    }
+    // the only clock read of the iteration, timers started by the events count from here
+    UpdateTime();
+
+    if( result == EventPresent && !DispatchEvents( event ) )
+      break;
+
+    DispatchTimers();
+  }
+
+  if( simulated )
+    SimulatedClock::Leave( theWakeupFD );
+
+  theDispatching = 0;
+} //}}}
+
+bool EventProcessor::DispatchEvents( EventPointer & aEvent ) //{{{
+{
+  // dispatch up to theBatchSize queued events back to back, timers wait for the next round
+  unsigned int dispatched = 0;
+  do
+  {
+    OnEvent( aEvent );
+
+    if( aEvent->ID() == EVENT_FINISH )
+      return false;
   }
+  while( ++dispatched < theBatchSize && GetEvent( aEvent, NO_WAIT ) == EventPresent );
+
+  return true;
+} //}}}
+
+void EventProcessor::DispatchTimers() //{{{
+{
+  // all timers due now as one batch, the clock is not read again
+  if( !CollectExpiredTimers() )
+    return;
+
+  ExpiredTimer timer;
+  while( PopExpiredTimer( timer ) )
+  {
+    int overruns = static_cast<int>( timer.theOverruns );
+
+    // the timers hold the event as RefCounted, it is handed over without touching the count
+    EventPointer ptr;
+    if( timer.theEvent )
+      ptr = EventPointer( static_cast<Event*>( timer.theEvent.detach() ), false );
+    else if( timer.theID >= 0 )
+      ptr = EventPointer( new Event( TIMER_ELAPSED( timer.theID ), overruns ) );
+    else
+      ptr = EventPointer( new PayloadEvent( TIMER_HANDLE_ELAPSED, timer.theHandle, overruns ) );
+
+    DBGOUT_DEBUG( Debug::Prefix() << "EventProcessor(" << GetID() << ")::DispatchTimers timer " << timer.theID << " slot " << timer.theHandle.theSlot << std:: endl );
+    OnEvent( ptr );
+  }
+} //}}}
+
+// the timer layer holds events as RefCounted, the overloads taking an Event live with the events
+TimerHandle TimerSystem::StartTimer( unsigned long aDelay, const boost::intrusive_ptr<Event> & aEvent ) //{{{
+{
+  DEBUG_TRACER;
+
+  return PushTimer( -1, Ticks( aDelay ), false, CatchUpSkip, aEvent );
+} //}}}
+
+TimerHandle TimerSystem::StartZyclicTimer( unsigned long aDelay, const boost::intrusive_ptr<Event> & aEvent, CatchUpPolicy aPolicy /*= CatchUpSkip*/ ) //{{{
+{
+  DEBUG_TRACER;
+
+  return PushTimer( -1, Ticks( aDelay ), true, aPolicy, aEvent );
+} //}}}
+
+TimerHandle TimerSystem::StartTimer( const boost::posix_time::time_duration & aDelay, const boost::intrusive_ptr<Event> & aEvent ) //{{{
+{
+  DEBUG_TRACER;
+
+  return PushTimer( -1, Ticks( aDelay ), false, CatchUpSkip, aEvent );
+} //}}}
+
+TimerHandle TimerSystem::StartZyclicTimer( const boost::posix_time::time_duration & aDelay, const boost::intrusive_ptr<Event> & aEvent, CatchUpPolicy aPolicy /*= CatchUpSkip*/ ) //{{{
+{
+  DEBUG_TRACER;
+
+  return PushTimer( -1, Ticks( aDelay ), true, aPolicy, aEvent );
 } //}}}
 
 void EventProcessor::OnEvent( const EventPointer & aEvent ) //{{{
@@ -209,7 +1005,7 @@ bool EventProcessor::IsEventOfInteres( const EventPointer & aEvent ) const //{{{
   return IsSystemEvent( aEvent ) || IsUserEventOfInteres( aEvent );
 } //}}}
 
-bool EventProcessor::IsSystemEvent( const EventPointer & aEvent ) const //{{{
+bool EventProcessor::IsSystemEvent( const EventPointer & aEvent ) //{{{
 {
   switch( aEvent->ID() )
   {
@@ -224,6 +1020,96 @@ bool EventProcessor::IsSystemEvent( const EventPointer & aEvent ) const //{{{
   return false;
 } //}}}
 
+void ProcessorScheduler::Wake( EventProcessor & aProcessor ) //{{{
+{
+  int state = aProcessor.theRunState.load();
+  for( ;; )
+  {
+    switch( state )
+    {
+      case RunIdle:
+        if( aProcessor.theRunState.compare_exchange_weak( state, RunScheduled ) )
+        {
+          Schedule( aProcessor );
+          return;
+        }
+        break;
+
+      case RunRunning:
+        if( aProcessor.theRunState.compare_exchange_weak( state, RunNotified ) )
+          return;
+        break;
+
+      default: // already on a run queue, already flagged or finished
+        return;
+    }
+  }
+} //}}}
+
+void ProcessorScheduler::Bind( EventProcessor & aProcessor ) //{{{
+{
+  Assert( !aProcessor.theScheduler.load() );
+
+  aProcessor.theRunState.store( RunScheduled );
+  aProcessor.theScheduler.store( this );
+} //}}}
+
+void ProcessorScheduler::Unbind( EventProcessor & aProcessor ) //{{{
+{
+  aProcessor.theScheduler.store( 0 );
+  aProcessor.theRunState.store( RunIdle );
+} //}}}
+
+bool ProcessorScheduler::RunSlice( EventProcessor & aProcessor ) //{{{
+{
+  DEBUG_TRACER;
+
+  aProcessor.theRunState.store( RunRunning );
+  aProcessor.UpdateTime();
+
+  // a worker runs one processor after the other, restore what it dispatched before
+  EventProcessor* dispatching = theDispatching;
+  theDispatching = &aProcessor;
+
+  bool running = true;
+  EventPointer event;
+  if( aProcessor.GetEvent( event, NO_WAIT ) == EventProcessor::EventPresent && !aProcessor.DispatchEvents( event ) )
+  {
+    aProcessor.theRunState.store( RunFinished );
+    running = false;
+  }
+  else
+    aProcessor.DispatchTimers();
+
+  theDispatching = dispatching;
+
+  return running;
+} //}}}
+
+bool ProcessorScheduler::Suspend( EventProcessor & aProcessor ) //{{{
+{
+  if( aProcessor.IsQueueEmpty() )
+  {
+    int state = RunRunning;
+    if( aProcessor.theRunState.compare_exchange_strong( state, RunIdle ) )
+      return true;
+  }
+
+  // more events, or woken while running
+  aProcessor.theRunState.store( RunScheduled );
+  return false;
+} //}}}
+
+bool ProcessorScheduler::IsFinished( const EventProcessor & aProcessor ) //{{{
+{
+  return aProcessor.theRunState.load() == RunFinished;
+} //}}}
+
+std::pair<bool,TimerWheel::Tick> ProcessorScheduler::GetNextExpiry( const EventProcessor & aProcessor ) //{{{
+{
+  return aProcessor.GetNextExpiry();
+} //}}}
+
 } // end namespace Event
 
 /* {{{ Modeline for ViM
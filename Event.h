@@ -9,34 +9,147 @@
 #define EVENT_H
 
 
-#include <boost/shared_ptr.hpp>
-#include <boost/circular_buffer.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/atomic.hpp>
 #include <boost/utility.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/has_trivial_copy.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 #include "Debug.h"
+#include "EventPool.h"
+#include "Mailbox.h"
+#include "RefCounted.h"
 
+#include <cstring>
+#include <vector>
+
+#include <sys/poll.h>
 
 #include "TimerSystem.h"
 
 namespace Event
 {
 
-class Event //{{{
+//! \brief mailbox lane of an event, lower values are dequeued first
+enum EventPriority
+{
+  PRIORITY_URGENT = 0,
+  PRIORITY_NORMAL = 1,
+  PRIORITY_BULK   = 2,
+  PRIORITY_LEVELS = 3
+};
+
+class Event : public RefCounted //{{{
 {
 public:
-  Event( unsigned long aID, int aParam = 0 ) : theID( aID ), theParam( aParam ) {};
+  Event( unsigned long aID, int aParam = 0, EventPriority aPriority = PRIORITY_NORMAL )
+    : thePayloadSize( 0 ), thePriority( aPriority ), theID( aID ), theParam( aParam ) {};
+  Event( const Event & aOther )
+    : RefCounted(), thePayloadSize( 0 ), thePriority( aOther.thePriority ), theID( aOther.theID ), theParam( aOther.theParam ) {};
   virtual ~Event() {};
 
+  Event & operator=( const Event & aOther )
+  {
+    thePriority = aOther.thePriority;
+    theID = aOther.theID;
+    theParam = aOther.theParam;
+    return *this;
+  }
+
   unsigned int ID() const { return theID; };
   int Param() const { return theParam; };
 
+  EventPriority Priority() const { return static_cast<EventPriority>( thePriority ); }
+  void SetPriority( EventPriority aPriority ) { thePriority = aPriority; }
+
+  //! \brief size of the inline payload, 0 for events without payload
+  std::size_t PayloadSize() const { return thePayloadSize; }
+
+  //! \brief typed access to the inline payload of a PayloadEvent, no dynamic_cast involved
+  template<typename T> const T & Payload() const;
+
+  //! events (and derived events up to EventPool::CELL_SIZE) live in pool cells
+  static void* operator new( std::size_t aSize ) { return EventPool::Allocate( aSize ); }
+  static void operator delete( void* aPtr, std::size_t aSize ) { EventPool::Deallocate( aPtr, aSize ); }
+
+protected:
+  Event( unsigned long aID, int aParam, unsigned short aPayloadSize )
+    : thePayloadSize( aPayloadSize ), thePriority( PRIORITY_NORMAL ), theID( aID ), theParam( aParam ) {};
+
+  void SetPayloadSize( std::size_t aSize ) { thePayloadSize = aSize; }
+
 private:
+  unsigned short thePayloadSize;
+  unsigned char thePriority;
   unsigned long theID;
   int theParam;
 }; //}}}
 
-typedef boost::shared_ptr<Event> EventPointer;
+//! \brief event with a small inline payload
+//!
+//! The payload is copied into the event itself, so a sample or an id travels
+//! inside the same pool cell as the event header. Any trivially copyable type
+//! up to PAYLOAD_SIZE bytes can be carried:
+//! \code
+//! SendEvent( EventPointer( new PayloadEvent( SensorSample, sample ) ) );
+//! ...
+//! const Sample & s = aEvent->Payload<Sample>();
+//! \endcode
+class PayloadEvent : public Event //{{{
+{
+public:
+  enum { PAYLOAD_SIZE = 48 };
+
+  template<typename T>
+  PayloadEvent( unsigned long aID, const T & aValue, int aParam = 0 )
+    : Event( aID, aParam, sizeof( T ) )
+  {
+    BOOST_STATIC_ASSERT( sizeof( T ) <= PAYLOAD_SIZE );
+    BOOST_STATIC_ASSERT( boost::has_trivial_copy<T>::value );
+    std::memcpy( thePayload.theBytes, &aValue, sizeof( T ) );
+  }
+
+  PayloadEvent( const PayloadEvent & aOther )
+    : Event( aOther.ID(), aOther.Param(), aOther.PayloadSize() )
+  {
+    SetPriority( aOther.Priority() );
+    std::memcpy( thePayload.theBytes, aOther.thePayload.theBytes, PAYLOAD_SIZE );
+  }
+
+  PayloadEvent & operator=( const PayloadEvent & aOther )
+  {
+    Event::operator=( aOther );
+    std::memcpy( thePayload.theBytes, aOther.thePayload.theBytes, PAYLOAD_SIZE );
+    SetPayloadSize( aOther.PayloadSize() );
+    return *this;
+  }
+
+  const void* PayloadData() const { return thePayload.theBytes; }
+
+private:
+  union
+  {
+    char theBytes[PAYLOAD_SIZE];
+    long long theAlignLong;
+    double theAlignDouble;
+  } thePayload;
+}; //}}}
+
+BOOST_STATIC_ASSERT( sizeof( PayloadEvent ) <= EventPool::CELL_SIZE );
+
+template<typename T>
+inline const T & Event::Payload() const //{{{
+{
+  BOOST_STATIC_ASSERT( sizeof( T ) <= PayloadEvent::PAYLOAD_SIZE );
+  Assert( sizeof( T ) <= thePayloadSize );
+
+  return *static_cast<const T*>( static_cast<const PayloadEvent*>( this )->PayloadData() );
+} //}}}
+
+typedef boost::intrusive_ptr<Event> EventPointer;
 
 enum ReservedEvents
 {
@@ -51,27 +164,160 @@ enum ReservedEvents
 // TODO constexpr
 #define TIMER_ELAPSED( id ) ( EVENT_TIMEOUT + (id) )
 
+//! \brief expiry of a timer started without ID, the TimerHandle is the payload
+enum { TIMER_HANDLE_ELAPSED = TIMER_ELAPSED( 0x100 ) };
+
 enum { NO_WAIT = 0, WAIT_FOREWER = -1 };
 
+class EventProcessor;
+
+//! \brief base of schedulers that run EventProcessors without a thread of their own
+//!
+//! A bound processor is always in one run state. Wake moves an idle
+//! processor to Scheduled and hands it to Schedule exactly once. Waking a
+//! running processor only flags it, and Suspend then reports that it must
+//! be scheduled again. So a processor is never on two run queues at once
+//! and OnEvent is never called concurrently for the same processor.
+//! The schedulers sleep in real time until timer deadlines, so they refuse
+//! Clock::SourceSimulated, see SimulatedClock
+class ProcessorScheduler : private Clock::RealTimeUser //{{{
+{
+public:
+  virtual ~ProcessorScheduler() {}
+
+  //! \brief a producer or a due timer made aProcessor runnable
+  void Wake( EventProcessor & aProcessor );
+
+protected:
+  explicit ProcessorScheduler( const char * aName ) : Clock::RealTimeUser( aName ) {}
+
+  enum RunState { RunIdle, RunScheduled, RunRunning, RunNotified, RunFinished };
+
+  //! \brief put a processor that just left RunIdle on a run queue
+  virtual void Schedule( EventProcessor & aProcessor ) = 0;
+
+  //! \brief route wakeups of aProcessor to this scheduler, aProcessor starts scheduled
+  void Bind( EventProcessor & aProcessor );
+  static void Unbind( EventProcessor & aProcessor );
+
+  //! \brief dispatch one batch of queued events and the expired timers
+  //! \return false once EVENT_FINISH was dispatched, the processor is then RunFinished
+  static bool RunSlice( EventProcessor & aProcessor );
+
+  //! \brief after RunSlice
+  //! \return true if the processor went idle, false if it has to be scheduled again
+  static bool Suspend( EventProcessor & aProcessor );
+
+  static bool IsFinished( const EventProcessor & aProcessor );
+
+  //! \brief deadline of the next timer of aProcessor in Clock::Microseconds, see TimerSystem::GetNextExpiry
+  //! a slice takes time, a wait computed from the deadline and a fresh clock read is not stretched by it
+  static std::pair<bool,TimerWheel::Tick> GetNextExpiry( const EventProcessor & aProcessor );
+}; //}}}
+
 class EventProcessor : protected TimerSystem, protected boost::noncopyable //{{{
 {
 public:
-  EventProcessor( unsigned int aID );
+  enum { EVENTQ_MAX_SIZE = 256 };
+
+  //! \brief what PushEvent does when the event queue is full
+  //! whatever the policy, a control event (see IsSystemEvent) is queued as by OverflowDropOldest
+  enum OverflowPolicy
+  {
+    OverflowBlock,      //!< wait until the consumer makes room (drops if the consumer pushes to itself
+                        //!< or the producer is run by a ProcessorScheduler, which must not wait)
+    OverflowDropNewest, //!< discard the event being pushed (the default)
+    OverflowDropOldest, //!< discard the oldest queued event, control events are kept while the lane holds others
+    OverflowCoalesce    //!< park the event aside, a later event with the same ID replaces it
+                        //!< urgent and control events are never parked, they are handled as by OverflowDropOldest
+  };
+
+  //! \brief how GetEvent picks between the priority lanes
+  enum DequeueMode
+  {
+    DequeueStrict,  //!< always the most urgent non-empty lane
+    DequeueWeighted //!< weighted round robin, see SetLaneWeight
+  };
+
+  struct OverflowStatistics
+  {
+    unsigned long theDropped;
+    unsigned long theCoalesced;
+    unsigned long theBlocked;
+    unsigned long long theBlockedMicroseconds;
+  };
+
+  //! OverflowBlock stalls the producer, be it Broadcast or the thread of
+  //! another processor, for as long as the consumer does not keep up, so
+  //! it has to be asked for explicitly
+  EventProcessor( unsigned int aID, std::size_t aCapacity = EVENTQ_MAX_SIZE, OverflowPolicy aPolicy = OverflowDropNewest );
   virtual ~EventProcessor();
 
-  void PushEvent( const EventPointer & aEvent );
+  //! \return false if the overflow policy discarded the event
+  bool PushEvent( const EventPointer & aEvent );
+
+  //! \brief queue aEvent without touching its reference count
+  bool PushEvent( EventPointer && aEvent );
+
+  //! \brief change the overflow policy, call before events are pushed
+  void SetOverflowPolicy( OverflowPolicy aPolicy ) { theOverflowPolicy = aPolicy; }
+  OverflowPolicy GetOverflowPolicy() const { return theOverflowPolicy; }
+  OverflowStatistics GetOverflowStatistics() const;
+
+  //! \brief lane selection, call before events are pushed
+  void SetDequeueMode( DequeueMode aMode ) { theDequeueMode = aMode; }
+  DequeueMode GetDequeueMode() const { return theDequeueMode; }
+
+  //! \brief events taken from a lane per round in DequeueWeighted mode
+  void SetLaneWeight( EventPriority aLane, unsigned int aWeight );
 
+  //! \brief event loop of a processor with its own thread, see ActiveObject
   void Run();
 
   inline unsigned int GetID() const { return theID; }
 
+  //! \brief descriptor whose readability makes the processor runnable, -1 for none
+  //! used by schedulers that wait for many processors at once, see CooperativeScheduler
+  virtual int GetPollFD() const { return -1; }
+
+  //! \brief number of queued events Run dispatches before it looks at the timers again
+  //! 1 (the default) gives the lowest timer latency, larger values the best throughput
+  void SetBatchSize( unsigned int aBatchSize ) { theBatchSize = aBatchSize ? aBatchSize : 1; }
+  unsigned int GetBatchSize() const { return theBatchSize; }
+
+  //! \brief deliver broadcasts with this ID (or ID range) to the processor
+  //!
+  //! SendEvent looks subscribed processors up by event ID instead of asking
+  //! every processor. A processor without subscriptions is still asked
+  //! through IsUserEventOfInteres. System events reach every processor.
+  void Subscribe( unsigned int aID );
+  void Subscribe( unsigned int aFirstID, unsigned int aLastID );
+
   bool IsEventOfInteres( const EventPointer & aEvent ) const;
+  static bool IsSystemEvent( const EventPointer & aEvent );
 protected:
-  enum { EVENTQ_MAX_SIZE = 256 };
   enum EventResult { EventPresent, EventTimeout, EventError };
 
+  //! \param aMaxWaitTime in microseconds, like the timeouts of TimerSystem
   virtual EventResult GetEvent( EventPointer & aEvent, long aMaxWaitTime = WAIT_FOREWER );
 
+  //! \brief park the consumer until an event is pushed, an extra descriptor is ready or aMaxWaitTime (microseconds) expires
+  //! \return number of ready descriptors, the wakeup descriptor included
+  int WaitForEvents( long aMaxWaitTime, pollfd * aExtraFDs = 0, unsigned int aExtraCount = 0 );
+
+  //! \brief take the next queued event without waiting
+  bool PopEvent( EventPointer & aEvent );
+
+  //! \brief dispatch aEvent and up to theBatchSize - 1 further queued events
+  //! \return false if EVENT_FINISH was among them
+  bool DispatchEvents( EventPointer & aEvent );
+
+  //! \brief dispatch every timer expired at the current time
+  void DispatchTimers();
+
+  //! \brief a ProcessorScheduler runs the processor instead of Run
+  bool IsScheduled() const { return theScheduler.load( boost::memory_order_relaxed ) != 0; }
+
   virtual void OnEvent( const EventPointer & aEvent );
   virtual bool IsUserEventOfInteres( const EventPointer & /*aEvent*/ ) const
   {
@@ -80,16 +326,104 @@ protected:
 
 //private:
   unsigned int theID;
-  int thePipeFDs[2];
+  unsigned int theBatchSize;
 
-  boost::circular_buffer< EventPointer > theEventQueue;
-  boost::mutex theLock;
+  //! eventfd, written only when a producer finds the consumer parked
+  int theWakeupFD;
+  boost::atomic<bool> theParked;
 
-  bool IsSystemEvent( const EventPointer & aEvent ) const;
+  //! one mailbox per EventPriority, each with the capacity given to the constructor
+  boost::ptr_vector< Mailbox< EventPointer > > theEventQueues;
+
+  bool IsQueueEmpty() const;
+
+private:
+  friend class ProcessorScheduler;
+  friend class EventProcessorCollection;
+
+  enum PushResult { PushQueued, PushDropped, PushFull };
+
+  //! \brief OverflowBlock reports PushFull instead of waiting, for producers that must not wait yet
+  template<typename P> PushResult TryPushEvent( P && aEvent );
+
+  //! \brief a producer found the processor in the registry and waits for room without holding it
+  void Pin() { thePins.fetch_add( 1 ); }
+  void Unpin() { thePins.fetch_sub( 1, boost::memory_order_release ); }
+
+  //! \brief after the last registry reader that saw the processor: blocked producers give up, return once none is pinned
+  void Close();
+
+  template<typename P> PushResult Enqueue( P && aEvent, bool aMayBlock );
+  void WakeConsumer();
+  bool HandleOverflow( const EventPointer & aEvent, unsigned int aLane );
+  bool PushBlocking( const EventPointer & aEvent, Mailbox< EventPointer > & aQueue );
+  bool PushDroppingOldest( const EventPointer & aEvent, Mailbox< EventPointer > & aQueue );
+  void FlushCoalesced();
+  bool PopFromLanes( EventPointer & aEvent );
+
+  static unsigned int LaneOf( const EventPointer & aEvent )
+  {
+    unsigned int lane = aEvent->Priority();
+    return lane < PRIORITY_LEVELS ? lane : static_cast<unsigned int>( PRIORITY_BULK );
+  }
+
+  //! \brief OverflowCoalesce parks events of the normal and bulk lanes only
+  static bool IsCoalescable( const EventPointer & aEvent, unsigned int aLane )
+  {
+    return aLane != PRIORITY_URGENT && !IsSystemEvent( aEvent );
+  }
+
+  OverflowPolicy theOverflowPolicy;
+
+  DequeueMode theDequeueMode;
+  unsigned int theLaneWeights[PRIORITY_LEVELS];
+  unsigned int theLaneCredits[PRIORITY_LEVELS];
+
+  //! set while a ProcessorScheduler runs this processor instead of Run
+  boost::atomic<ProcessorScheduler*> theScheduler;
+  boost::atomic<int> theRunState;
+
+  //! producers waiting in PushBlocking, the consumer notifies theRoomCondition only if there are any
+  boost::atomic<unsigned int> theBlockedProducers;
+  boost::mutex theRoomLock;
+  boost::condition_variable theRoomCondition;
+
+  boost::atomic<unsigned int> thePins;
+  //! set by Close, PushBlocking drops instead of waiting
+  boost::atomic<bool> theClosing;
+
+  //! overflowed events of OverflowCoalesce per lane, at most one per event ID, oldest first
+  std::vector< EventPointer > theCoalesced[PRIORITY_LEVELS];
+  //! bit 1 << lane is set while theCoalesced[lane] is not empty
+  boost::atomic<unsigned int> theCoalescedLanes;
+  boost::mutex theCoalesceLock;
+
+  boost::atomic<unsigned long> theDropped;
+  boost::atomic<unsigned long> theCoalescedCount;
+  boost::atomic<unsigned long> theBlocked;
+  boost::atomic<unsigned long long> theBlockedMicroseconds;
 }; //}}}
 
 
 void SendEvent( const EventPointer & aEvent );
+
+//! \brief deliver aEvent to the processor with GetID() == aProcessorID only
+//! \return false if there is no such processor or it discarded the event
+bool SendEventTo( unsigned int aProcessorID, const EventPointer & aEvent );
+
+//! \brief as above, the event is handed over without sharing it
+bool SendEventTo( unsigned int aProcessorID, EventPointer && aEvent );
+
+enum SendResult
+{
+  SendQueued,
+  SendDropped,    //!< the overflow policy of the processor discarded the event
+  SendFull,       //!< an OverflowBlock mailbox has no room, nothing was queued
+  SendNoProcessor
+};
+
+//! \brief SendEventTo for producers that must never wait, e.g. a timer thread
+SendResult TrySendEventTo( unsigned int aProcessorID, const EventPointer & aEvent );
 }
 
 #endif /* ifndef EVENT_H */
@@ -0,0 +1,217 @@
+/*! {{{ File head comment
+  \file EventPool.cpp
+
+  \brief
+
+  }}} */
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#include <new>
+#include <vector>
+#include <stdlib.h>
+
+#include "EventPool.h"
+#include "Debug.h"
+
+namespace Event
+{
+
+namespace
+{
+
+union Cell //{{{
+{
+  Cell* theNext;
+  char theStorage[ EventPool::CELL_SIZE ];
+}; //}}}
+
+//! \brief cells shared between threads, kept as chains of TRANSFER_BATCH cells
+class Depot //{{{
+{
+public:
+  Depot() : theLoose( 0 ), theLooseCount( 0 ) {}
+
+  Cell* Acquire();
+  void Release( Cell* aChain );
+  void ReleaseOne( Cell* aCell );
+
+private:
+  Cell* NewSlab();
+
+  std::vector< Cell* > theBatches;
+  Cell* theLoose;
+  unsigned int theLooseCount;
+
+  boost::mutex theLock;
+}; //}}}
+
+Cell* Depot::Acquire() //{{{
+{
+  boost::lock_guard<boost::mutex> guard( theLock );
+
+  if( !theBatches.empty() )
+  {
+    Cell* chain = theBatches.back();
+    theBatches.pop_back();
+    return chain;
+  }
+
+  if( theLoose )
+  {
+    Cell* chain = theLoose;
+    theLoose = 0;
+    theLooseCount = 0;
+    return chain;
+  }
+
+  return NewSlab();
+} //}}}
+
+void Depot::Release( Cell* aChain ) //{{{
+{
+  boost::lock_guard<boost::mutex> guard( theLock );
+  theBatches.push_back( aChain );
+} //}}}
+
+void Depot::ReleaseOne( Cell* aCell ) //{{{
+{
+  boost::lock_guard<boost::mutex> guard( theLock );
+
+  aCell->theNext = theLoose;
+  theLoose = aCell;
+
+  if( ++theLooseCount == EventPool::TRANSFER_BATCH )
+  {
+    theBatches.push_back( theLoose );
+    theLoose = 0;
+    theLooseCount = 0;
+  }
+} //}}}
+
+Cell* Depot::NewSlab() //{{{
+{
+  void* mem = 0;
+  // cache line aligned, so events of different threads never share a line
+  if( 0 != posix_memalign( &mem, 64, sizeof( Cell ) * EventPool::CELLS_PER_SLAB ) )
+  {
+    DBGOUT_FATAL( Debug::Prefix() << "Could not allocate event slab\n" );
+    throw std::bad_alloc();
+  }
+
+  Cell* cells = static_cast<Cell*>( mem );
+  for( unsigned int i = 0; i + 1 < EventPool::CELLS_PER_SLAB; ++i )
+    cells[i].theNext = &cells[i + 1];
+  cells[EventPool::CELLS_PER_SLAB - 1].theNext = 0;
+
+  return cells;
+} //}}}
+
+//! never destroyed: events may be released during static destruction
+Depot & TheDepot() //{{{
+{
+  static Depot* depot = new Depot;
+  return *depot;
+} //}}}
+
+__thread bool theCacheDestroyed = false;
+
+struct ThreadCache //{{{
+{
+  ThreadCache() : theFree( 0 ), theCount( 0 ) {}
+
+  ~ThreadCache()
+  {
+    while( theFree )
+    {
+      Cell* cell = theFree;
+      theFree = cell->theNext;
+      TheDepot().ReleaseOne( cell );
+    }
+    theCacheDestroyed = true;
+  }
+
+  //! give back one batch, keep the most recently used cells
+  void Trim()
+  {
+    Cell* chain = theFree;
+    Cell* last = chain;
+    for( unsigned int i = 1; i < EventPool::TRANSFER_BATCH; ++i )
+      last = last->theNext;
+
+    theFree = last->theNext;
+    last->theNext = 0;
+    theCount -= EventPool::TRANSFER_BATCH;
+
+    // the chain is reversed relative to allocation order, which does not matter
+    TheDepot().Release( chain );
+  }
+
+  Cell* theFree;
+  unsigned int theCount;
+}; //}}}
+
+thread_local ThreadCache theCache;
+
+}
+
+void* EventPool::Allocate( std::size_t aSize ) //{{{
+{
+  if( aSize > CELL_SIZE )
+    return ::operator new( aSize );
+
+  // thread is exiting: hand out a full sized cell, it joins the pool on release
+  if( theCacheDestroyed )
+    return ::operator new( CELL_SIZE );
+
+  ThreadCache & cache = theCache;
+
+  if( !cache.theFree )
+  {
+    cache.theFree = TheDepot().Acquire();
+    cache.theCount = 0;
+    for( Cell* cell = cache.theFree; cell; cell = cell->theNext )
+      ++cache.theCount;
+  }
+
+  Cell* cell = cache.theFree;
+  cache.theFree = cell->theNext;
+  --cache.theCount;
+
+  return cell;
+} //}}}
+
+void EventPool::Deallocate( void* aPtr, std::size_t aSize ) //{{{
+{
+  if( !aPtr )
+    return;
+
+  if( aSize > CELL_SIZE )
+  {
+    ::operator delete( aPtr );
+    return;
+  }
+
+  Cell* cell = static_cast<Cell*>( aPtr );
+
+  if( theCacheDestroyed )
+  {
+    TheDepot().ReleaseOne( cell );
+    return;
+  }
+
+  ThreadCache & cache = theCache;
+
+  cell->theNext = cache.theFree;
+  cache.theFree = cell;
+
+  if( ++cache.theCount >= 2 * TRANSFER_BATCH )
+    cache.Trim();
+} //}}}
+
+} // end namespace Event
+
+/* {{{ Modeline for ViM
+ * vim600:fdm=marker fdl=0 fdc=3:
+ * }}} */
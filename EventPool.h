@@ -0,0 +1,44 @@
+/*! {{{
+  \file EventPool.h
+
+  \brief Fixed-size cell allocator for events
+
+  }}} */
+
+#ifndef EVENTPOOL_H
+#define EVENTPOOL_H
+
+#include <cstddef>
+
+namespace Event
+{
+
+//! \brief slab allocator for event objects
+//!
+//! Every thread keeps a private free list of cells, so allocation and
+//! release of an event normally costs a couple of pointer operations.
+//! Cells released by a consumer thread are returned to a shared depot in
+//! batches once the thread cache grows too large; producer threads refill
+//! their cache from the depot a batch at a time.
+//! Requests larger than CELL_SIZE are passed to the global operator new.
+class EventPool //{{{
+{
+public:
+  enum
+  {
+    CELL_SIZE      = 128, //!< one cell, big enough for derived events with small members
+    CELLS_PER_SLAB = 512, //!< cells carved out of one slab allocation
+    TRANSFER_BATCH = 128  //!< cells moved between a thread cache and the depot at once
+  };
+
+  static void* Allocate( std::size_t aSize );
+  static void Deallocate( void* aPtr, std::size_t aSize );
+}; //}}}
+
+}
+
+#endif /* ifndef EVENTPOOL_H */
+
+/* {{{ Modeline for ViM
+ * vim600:fdm=marker fdl=0 fdc=3:
+ * }}} */
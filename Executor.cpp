@@ -0,0 +1,279 @@
+/*! {{{ File head comment
+  \file Executor.cpp
+
+  \brief
+
+  }}} */
+
+#include <boost/bind/bind.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "Executor.h"
+#include "Clock.h"
+#include "Debug.h"
+
+using namespace boost::posix_time;
+
+namespace Event
+{
+
+namespace
+{
+//! worker the calling thread belongs to, new work is queued there first
+__thread Executor* theCurrentExecutor = 0;
+__thread unsigned int theCurrentWorker = 0;
+}
+
+Executor::Executor( unsigned int aWorkers /*= 0*/ ) //{{{
+  : ProcessorScheduler( "Executor" ), theNextWorker( 0 ), thePending( 0 ), theIdleWorkers( 0 ), theStopping( false )
+{
+  DEBUG_TRACER;
+
+  if( !aWorkers )
+    aWorkers = boost::thread::hardware_concurrency();
+  if( !aWorkers )
+    aWorkers = 1;
+
+  for( unsigned int i = 0; i < aWorkers; ++i )
+    theWorkers.push_back( new Worker );
+
+  for( unsigned int i = 0; i < aWorkers; ++i )
+    theThreads.create_thread( boost::bind( &Executor::WorkerLoop, this, i ) );
+
+  theThreads.create_thread( boost::bind( &Executor::TimerLoop, this ) );
+} //}}}
+
+Executor::~Executor() //{{{
+{
+  DEBUG_TRACER;
+
+  Assert( theTimerStates.empty() );
+
+  {
+    boost::lock_guard<boost::mutex> guard( theIdleLock );
+    theStopping = true;
+    theIdleCondition.notify_all();
+  }
+  {
+    boost::lock_guard<boost::mutex> guard( theTimerLock );
+    theTimerCondition.notify_all();
+  }
+
+  theThreads.join_all();
+
+  for( std::vector< Worker* >::iterator it = theWorkers.begin(); it != theWorkers.end(); ++it )
+    delete *it;
+} //}}}
+
+void Executor::Attach( EventProcessor & aProcessor ) //{{{
+{
+  DEBUG_TRACER;
+
+  {
+    boost::lock_guard<boost::mutex> guard( theTimerLock );
+    theTimerStates[&aProcessor] = TimerState();
+  }
+
+  // the first slice picks up whatever was queued before
+  Bind( aProcessor );
+  Schedule( aProcessor );
+} //}}}
+
+void Executor::Stop( EventProcessor & aProcessor ) //{{{
+{
+  DEBUG_TRACER;
+
+  // EVENT_FINISH makes room for itself, it fails only while the lane holds control events alone
+  EventPointer finish( new Event( EVENT_FINISH, 0, PRIORITY_URGENT ) );
+  while( !aProcessor.PushEvent( finish ) )
+    boost::this_thread::yield();
+
+  {
+    boost::unique_lock<boost::mutex> lock( theFinishLock );
+    while( !IsFinished( aProcessor ) )
+      theFinishCondition.wait( lock );
+  }
+
+  {
+    boost::lock_guard<boost::mutex> guard( theTimerLock );
+    theTimerStates.erase( &aProcessor );
+  }
+
+  Unbind( aProcessor );
+} //}}}
+
+void Executor::Schedule( EventProcessor & aProcessor ) //{{{
+{
+  unsigned int index = theCurrentExecutor == this ? theCurrentWorker
+    : theNextWorker.fetch_add( 1, boost::memory_order_relaxed ) % theWorkers.size();
+
+  {
+    Worker & worker = *theWorkers[index];
+    boost::lock_guard<boost::mutex> guard( worker.theLock );
+    worker.theQueue.push_back( &aProcessor );
+  }
+
+  // pairs with the check in WorkerLoop: either the worker sees the count or we see it idle
+  ++thePending;
+  if( theIdleWorkers.load() )
+  {
+    boost::lock_guard<boost::mutex> guard( theIdleLock );
+    theIdleCondition.notify_one();
+  }
+} //}}}
+
+EventProcessor* Executor::NextProcessor( unsigned int aIndex ) //{{{
+{
+  {
+    Worker & own = *theWorkers[aIndex];
+    boost::lock_guard<boost::mutex> guard( own.theLock );
+    if( !own.theQueue.empty() )
+    {
+      EventProcessor* processor = own.theQueue.front();
+      own.theQueue.pop_front();
+      return processor;
+    }
+  }
+
+  // steal the most recently queued processor of another worker
+  for( unsigned int i = 1; i < theWorkers.size(); ++i )
+  {
+    Worker & victim = *theWorkers[( aIndex + i ) % theWorkers.size()];
+    boost::lock_guard<boost::mutex> guard( victim.theLock );
+    if( !victim.theQueue.empty() )
+    {
+      EventProcessor* processor = victim.theQueue.back();
+      victim.theQueue.pop_back();
+      return processor;
+    }
+  }
+
+  return 0;
+} //}}}
+
+void Executor::WorkerLoop( unsigned int aIndex ) //{{{
+{
+  DEBUG_TRACER;
+
+  theCurrentExecutor = this;
+  theCurrentWorker = aIndex;
+
+  for( ;; )
+  {
+    EventProcessor* processor = NextProcessor( aIndex );
+    if( processor )
+    {
+      --thePending;
+      RunProcessor( *processor );
+      continue;
+    }
+
+    boost::unique_lock<boost::mutex> lock( theIdleLock );
+    ++theIdleWorkers;
+    while( thePending.load() <= 0 && !theStopping )
+      theIdleCondition.wait( lock );
+    --theIdleWorkers;
+
+    if( theStopping )
+      return;
+  }
+} //}}}
+
+void Executor::RunProcessor( EventProcessor & aProcessor ) //{{{
+{
+  if( !RunSlice( aProcessor ) )
+  {
+    boost::lock_guard<boost::mutex> guard( theFinishLock );
+    theFinishCondition.notify_all();
+    return;
+  }
+
+  std::pair<bool,TimerWheel::Tick> expiry = GetNextExpiry( aProcessor );
+
+  // a due timer is just more work, the slice may have taken until its deadline
+  if( expiry.first && expiry.second <= Clock::Microseconds() )
+  {
+    if( Suspend( aProcessor ) )
+      Wake( aProcessor );
+    else
+      Schedule( aProcessor );
+    return;
+  }
+
+  // armed before going idle, a timer firing meanwhile flags the running processor
+  if( expiry.first )
+    StartTimer( aProcessor, expiry.second );
+
+  if( !Suspend( aProcessor ) )
+    Schedule( aProcessor );
+} //}}}
+
+void Executor::StartTimer( EventProcessor & aProcessor, TimerWheel::Tick aDeadline ) //{{{
+{
+  boost::lock_guard<boost::mutex> guard( theTimerLock );
+
+  // every slice asks again, an unchanged deadline must not pile up entries
+  TimerState & state = theTimerStates[&aProcessor];
+  if( aDeadline == state.theDeadline )
+    return;
+
+  TimerEntry entry;
+  entry.theDeadline = aDeadline;
+  entry.theProcessor = &aProcessor;
+  entry.theGeneration = ++state.theGeneration;
+
+  state.theDeadline = aDeadline;
+
+  bool earliest = theTimers.empty() || entry.theDeadline < theTimers.top().theDeadline;
+  theTimers.push( entry );
+
+  if( earliest )
+    theTimerCondition.notify_one();
+} //}}}
+
+void Executor::TimerLoop() //{{{
+{
+  DEBUG_TRACER;
+
+  boost::unique_lock<boost::mutex> lock( theTimerLock );
+
+  for( ;; )
+  {
+    {
+      boost::lock_guard<boost::mutex> guard( theIdleLock );
+      if( theStopping )
+        return;
+    }
+
+    if( theTimers.empty() )
+    {
+      theTimerCondition.wait( lock );
+      continue;
+    }
+
+    // a relative wait runs on the monotonic clock of the condition, a system_time would follow the wall clock
+    TimerEntry entry = theTimers.top();
+    TimerWheel::Tick now = Clock::Microseconds();
+    if( entry.theDeadline > now )
+    {
+      theTimerCondition.timed_wait( lock, microseconds( entry.theDeadline - now ) );
+      continue;
+    }
+
+    theTimers.pop();
+
+    // stale entries of restarted timers or stopped processors are skipped
+    TimerStates::iterator it = theTimerStates.find( entry.theProcessor );
+    if( it != theTimerStates.end() && it->second.theGeneration == entry.theGeneration )
+    {
+      it->second.theDeadline = 0;
+      Wake( *entry.theProcessor );
+    }
+  }
+} //}}}
+
+} // end namespace Event
+
+/* {{{ Modeline for ViM
+ * vim600:fdm=marker fdl=0 fdc=3:
+ * }}} */
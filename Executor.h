@@ -0,0 +1,115 @@
+/*! {{{
+  \file Executor.h
+
+  \brief
+
+  }}} */
+
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <deque>
+#include <queue>
+#include <vector>
+
+#include "Event.h"
+
+namespace Event
+{
+
+//! \brief runs many EventProcessors on a fixed set of worker threads
+//!
+//! Instead of one ActiveObject thread per processor, attached processors
+//! are put on a worker run queue whenever their mailbox turns non-empty or
+//! one of their timers is due. A worker runs one slice of the processor
+//! (a batch of events, see EventProcessor::SetBatchSize, and the expired
+//! timers) and queues it again if more work is pending. Workers take work
+//! from their own queue first and steal from the other queues when idle.
+//! A processor is never run by two workers at the same time.
+//!
+//! Workers never wait for room in a full mailbox: all of them could wait
+//! for processors only they would run. An event an attached processor sends
+//! to a full OverflowBlock mailbox is dropped and counted like OverflowDropNewest.
+class Executor : public ProcessorScheduler, private boost::noncopyable //{{{
+{
+public:
+  //! \param aWorkers number of worker threads, 0 for one per hardware thread
+  explicit Executor( unsigned int aWorkers = 0 );
+
+  //! \brief stops the workers, all processors must be stopped before
+  virtual ~Executor();
+
+  //! \brief run aProcessor on the workers from now on
+  void Attach( EventProcessor & aProcessor );
+
+  //! \brief send EVENT_FINISH to aProcessor and wait until it is dispatched, then detach it
+  void Stop( EventProcessor & aProcessor );
+
+protected:
+  virtual void Schedule( EventProcessor & aProcessor );
+
+private:
+  struct Worker //{{{
+  {
+    boost::mutex theLock;
+    std::deque< EventProcessor* > theQueue;
+  }; //}}}
+
+  struct TimerEntry //{{{
+  {
+    //! Clock::Microseconds
+    TimerWheel::Tick theDeadline;
+    EventProcessor* theProcessor;
+    unsigned long theGeneration;
+
+    bool operator<( const TimerEntry & other ) const { return theDeadline > other.theDeadline; }
+  }; //}}}
+
+  struct TimerState //{{{
+  {
+    TimerState() : theGeneration( 0 ), theDeadline( 0 ) {}
+
+    unsigned long theGeneration; //!< of the latest timer, older heap entries are stale
+    TimerWheel::Tick theDeadline; //!< of the latest timer, 0 if it fired
+  }; //}}}
+
+  typedef boost::unordered_map< EventProcessor*, TimerState > TimerStates;
+
+  void WorkerLoop( unsigned int aIndex );
+  void TimerLoop();
+
+  EventProcessor* NextProcessor( unsigned int aIndex );
+  void RunProcessor( EventProcessor & aProcessor );
+  void StartTimer( EventProcessor & aProcessor, TimerWheel::Tick aDeadline );
+
+  std::vector< Worker* > theWorkers;
+  boost::thread_group theThreads;
+  boost::atomic<unsigned int> theNextWorker;
+
+  //! processors queued on all workers, workers sleep while it is 0
+  boost::atomic<long> thePending;
+  boost::atomic<unsigned int> theIdleWorkers;
+  boost::mutex theIdleLock;
+  boost::condition_variable theIdleCondition;
+  bool theStopping;
+
+  //! one deadline per processor, older entries are recognized by the generation
+  std::priority_queue< TimerEntry > theTimers;
+  TimerStates theTimerStates;
+  boost::mutex theTimerLock;
+  boost::condition_variable theTimerCondition;
+
+  boost::mutex theFinishLock;
+  boost::condition_variable theFinishCondition;
+}; //}}}
+
+}
+
+#endif /* ifndef EXECUTOR_H */
+
+/* {{{ Modeline for ViM
+ * vim600:fdm=marker fdl=0 fdc=3:
+ * }}} */
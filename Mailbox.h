@@ -0,0 +1,158 @@
+/*! {{{
+  \file Mailbox.h
+
+  \brief Bounded lock-free event queue
+
+  }}} */
+
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <boost/atomic.hpp>
+#include <boost/utility.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+
+namespace Event
+{
+
+//! \brief bounded multi-producer queue without locks
+//!
+//! Array based queue after D. Vyukov: every cell carries a sequence number
+//! telling producers and consumers whether the cell is free or filled for
+//! the current lap, so Push and Pop each need a single CAS on their index.
+//! The enqueue and dequeue indices live on separate cache lines, producers
+//! therefore do not bounce the line the consumer works on.
+//! Pop is safe for several threads too, although an EventProcessor
+//! normally has a single consumer.
+//! The capacity is rounded up to a power of two.
+template<typename T>
+class Mailbox : private boost::noncopyable //{{{
+{
+public:
+  explicit Mailbox( std::size_t aCapacity );
+  ~Mailbox() { delete [] theCells; }
+
+  //! \return false if the queue is full
+  bool Push( const T & aValue ) { return Enqueue( aValue ); }
+
+  //! \brief aValue is moved from only if it was queued
+  bool Push( T && aValue ) { return Enqueue( std::move( aValue ) ); }
+
+  //! \return false if the queue is empty
+  bool Pop( T & aValue );
+
+  //! \brief snapshot, may be outdated when it returns
+  bool Empty() const
+  {
+    return theDequeuePos.load( boost::memory_order_acquire ) >= theEnqueuePos.load( boost::memory_order_acquire );
+  }
+
+  std::size_t Capacity() const { return theMask + 1; }
+
+private:
+  enum { CACHE_LINE = 64 };
+
+  template<typename U> bool Enqueue( U && aValue );
+
+  struct Cell
+  {
+    boost::atomic<std::size_t> theSequence;
+    T theValue;
+  };
+
+  Cell* theCells;
+  std::size_t theMask;
+
+  char thePad0[CACHE_LINE];
+  boost::atomic<std::size_t> theEnqueuePos;
+  char thePad1[CACHE_LINE - sizeof( boost::atomic<std::size_t> )];
+  boost::atomic<std::size_t> theDequeuePos;
+  char thePad2[CACHE_LINE - sizeof( boost::atomic<std::size_t> )];
+}; //}}}
+
+template<typename T>
+Mailbox<T>::Mailbox( std::size_t aCapacity ) //{{{
+  : theCells( 0 ), theMask( 0 ), theEnqueuePos( 0 ), theDequeuePos( 0 )
+{
+  std::size_t size = 2;
+  while( size < aCapacity )
+    size <<= 1;
+
+  theCells = new Cell[size];
+  theMask = size - 1;
+
+  for( std::size_t i = 0; i < size; ++i )
+    theCells[i].theSequence.store( i, boost::memory_order_relaxed );
+} //}}}
+
+template<typename T>
+template<typename U>
+bool Mailbox<T>::Enqueue( U && aValue ) //{{{
+{
+  Cell* cell;
+  std::size_t pos = theEnqueuePos.load( boost::memory_order_relaxed );
+
+  for( ;; )
+  {
+    cell = &theCells[pos & theMask];
+    std::size_t seq = cell->theSequence.load( boost::memory_order_acquire );
+    std::ptrdiff_t diff = static_cast<std::ptrdiff_t>( seq ) - static_cast<std::ptrdiff_t>( pos );
+
+    if( diff == 0 )
+    {
+      if( theEnqueuePos.compare_exchange_weak( pos, pos + 1, boost::memory_order_relaxed ) )
+        break;
+    }
+    else if( diff < 0 )
+      return false;
+    else
+      pos = theEnqueuePos.load( boost::memory_order_relaxed );
+  }
+
+  cell->theValue = std::forward<U>( aValue );
+  cell->theSequence.store( pos + 1, boost::memory_order_release );
+
+  return true;
+} //}}}
+
+template<typename T>
+bool Mailbox<T>::Pop( T & aValue ) //{{{
+{
+  Cell* cell;
+  std::size_t pos = theDequeuePos.load( boost::memory_order_relaxed );
+
+  for( ;; )
+  {
+    cell = &theCells[pos & theMask];
+    std::size_t seq = cell->theSequence.load( boost::memory_order_acquire );
+    std::ptrdiff_t diff = static_cast<std::ptrdiff_t>( seq ) - static_cast<std::ptrdiff_t>( pos + 1 );
+
+    if( diff == 0 )
+    {
+      if( theDequeuePos.compare_exchange_weak( pos, pos + 1, boost::memory_order_relaxed ) )
+        break;
+    }
+    else if( diff < 0 )
+      return false;
+    else
+      pos = theDequeuePos.load( boost::memory_order_relaxed );
+  }
+
+  // leave an empty value in the cell, the queue must not keep events alive
+  aValue = T();
+  std::swap( aValue, cell->theValue );
+  cell->theSequence.store( pos + theMask + 1, boost::memory_order_release );
+
+  return true;
+} //}}}
+
+}
+
+#endif /* ifndef MAILBOX_H */
+
+/* {{{ Modeline for ViM
+ * vim600:fdm=marker fdl=0 fdc=3:
+ * }}} */
@@ -0,0 +1,60 @@
+/*! {{{
+  \file RefCounted.h
+
+  \brief Intrusive reference count of EventPointer
+
+  }}} */
+
+#ifndef REFCOUNTED_H
+#define REFCOUNTED_H
+
+#include <boost/atomic.hpp>
+
+namespace Event
+{
+
+//! \brief base of the objects held by a boost::intrusive_ptr, the count lives in the object
+//!
+//! Copying a pointer is an inline atomic increment. The timers hold the
+//! events they deliver as RefCounted, they do not need to know Event.
+class RefCounted //{{{
+{
+public:
+  virtual ~RefCounted() {}
+
+protected:
+  RefCounted() : theRefCount( 0 ) {}
+
+  //! a copy is a new object, nobody refers to it yet
+  RefCounted( const RefCounted & ) : theRefCount( 0 ) {}
+  RefCounted & operator=( const RefCounted & ) { return *this; }
+
+private:
+  friend void intrusive_ptr_add_ref( const RefCounted * aObject );
+  friend void intrusive_ptr_release( const RefCounted * aObject );
+
+  mutable boost::atomic<int> theRefCount;
+}; //}}}
+
+inline void intrusive_ptr_add_ref( const RefCounted * aObject ) //{{{
+{
+  aObject->theRefCount.fetch_add( 1, boost::memory_order_relaxed );
+} //}}}
+
+inline void intrusive_ptr_release( const RefCounted * aObject ) //{{{
+{
+  if( aObject->theRefCount.fetch_sub( 1, boost::memory_order_release ) == 1 )
+  {
+    boost::atomic_thread_fence( boost::memory_order_acquire );
+    // the destructor is virtual, the operator delete of the derived class is used
+    delete aObject;
+  }
+} //}}}
+
+}
+
+#endif /* ifndef REFCOUNTED_H */
+
+/* {{{ Modeline for ViM
+ * vim600:fdm=marker fdl=0 fdc=3:
+ * }}} */
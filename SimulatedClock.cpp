@@ -0,0 +1,247 @@
+/*! {{{ File head comment
+  \file SimulatedClock.cpp
+
+  \brief
+
+  }}} */
+
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <stdexcept>
+
+#include <sys/poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "SimulatedClock.h"
+#include "Debug.h"
+
+namespace Event
+{
+
+namespace
+{
+
+struct Participant //{{{
+{
+  Participant() : theIdle( false ), theWoken( false ), theDeadline( SimulatedClock::NO_DEADLINE ) {}
+
+  bool theIdle;
+  //! an event was queued since the participant last looked
+  bool theWoken;
+  boost::int64_t theDeadline;
+}; //}}}
+
+typedef boost::unordered_map< int, Participant > Participants;
+
+boost::atomic<boost::uint64_t> theTime( 0 );
+
+boost::mutex theLock;
+Participants theParticipants;
+unsigned int theBusy = 0;
+
+//! eventfd of an attached thread
+__thread int theThreadFD = -1;
+
+void Signal( int aWakeupFD ) //{{{
+{
+  uint64_t one = 1;
+  if( sizeof( one ) != write( aWakeupFD, &one, sizeof( one ) ) )
+  {
+    DBGOUT_FATAL( Debug::Prefix() << "Could not write to simulated clock wakeup descriptor\n" );
+    throw std::runtime_error( "SimulatedClock: Could not write to wakeup descriptor" );
+  }
+} //}}}
+
+void SetBusy( Participant & aParticipant ) //{{{
+{
+  if( !aParticipant.theIdle )
+    return;
+
+  aParticipant.theIdle = false;
+  aParticipant.theDeadline = SimulatedClock::NO_DEADLINE;
+  ++theBusy;
+} //}}}
+
+//! \brief jump to the earliest deadline once nobody is busy, theLock held
+void AdvanceIfIdle() //{{{
+{
+  if( theBusy )
+    return;
+
+  boost::int64_t next = SimulatedClock::NO_DEADLINE;
+  for( Participants::const_iterator it = theParticipants.begin(); it != theParticipants.end(); ++it )
+    if( it->second.theDeadline != SimulatedClock::NO_DEADLINE && ( next == SimulatedClock::NO_DEADLINE || it->second.theDeadline < next ) )
+      next = it->second.theDeadline;
+
+  // everybody waits for events from outside
+  if( next == SimulatedClock::NO_DEADLINE )
+    return;
+
+  if( static_cast<boost::uint64_t>( next ) > theTime.load( boost::memory_order_relaxed ) )
+    theTime.store( next, boost::memory_order_release );
+
+  for( Participants::iterator it = theParticipants.begin(); it != theParticipants.end(); ++it )
+  {
+    if( it->second.theDeadline == SimulatedClock::NO_DEADLINE || it->second.theDeadline > next )
+      continue;
+
+    SetBusy( it->second );
+    Signal( it->first );
+  }
+} //}}}
+
+}
+
+void SimulatedClock::Attach() //{{{
+{
+  DEBUG_TRACER;
+
+  if( theThreadFD >= 0 )
+    return;
+
+  theThreadFD = eventfd( 0, EFD_NONBLOCK );
+  if( theThreadFD < 0 )
+  {
+    DBGOUT_FATAL( Debug::Prefix() << "Could not create simulated clock wakeup descriptor\n" );
+    throw std::runtime_error( "SimulatedClock: Could not create wakeup descriptor" );
+  }
+
+  Join( theThreadFD );
+} //}}}
+
+void SimulatedClock::Detach() //{{{
+{
+  DEBUG_TRACER;
+
+  if( theThreadFD < 0 )
+    return;
+
+  Leave( theThreadFD );
+  close( theThreadFD );
+  theThreadFD = -1;
+} //}}}
+
+void SimulatedClock::Sleep( unsigned long aMilliseconds ) //{{{
+{
+  DEBUG_TRACER;
+
+  bool attached = theThreadFD >= 0;
+  if( !attached )
+    Attach();
+
+  // nobody wakes a thread, only the deadline ends the wait
+  Idle( theThreadFD, Now() + aMilliseconds * 1000ULL );
+
+  pollfd pollFD;
+  pollFD.fd = theThreadFD;
+  pollFD.events = POLLIN;
+  pollFD.revents = 0;
+  while( poll( &pollFD, 1, -1 ) < 0 && errno == EINTR )
+    ;
+
+  uint64_t count;
+  if( -1 == read( theThreadFD, &count, sizeof( count ) ) && errno != EAGAIN )
+  {
+    DBGOUT_FATAL( Debug::Prefix() << "Could not read from simulated clock wakeup descriptor\n" );
+    throw std::runtime_error( "SimulatedClock: Could not read from wakeup descriptor" );
+  }
+
+  Busy( theThreadFD );
+
+  if( !attached )
+    Detach();
+} //}}}
+
+boost::uint64_t SimulatedClock::Now() //{{{
+{
+  return theTime.load( boost::memory_order_acquire );
+} //}}}
+
+void SimulatedClock::SetTime( boost::uint64_t aNow ) //{{{
+{
+  theTime.store( aNow, boost::memory_order_release );
+} //}}}
+
+void SimulatedClock::Join( int aWakeupFD ) //{{{
+{
+  boost::lock_guard<boost::mutex> guard( theLock );
+
+  theParticipants[aWakeupFD] = Participant();
+  ++theBusy;
+} //}}}
+
+void SimulatedClock::Leave( int aWakeupFD ) //{{{
+{
+  boost::lock_guard<boost::mutex> guard( theLock );
+
+  Participants::iterator it = theParticipants.find( aWakeupFD );
+  if( it == theParticipants.end() )
+    return;
+
+  if( !it->second.theIdle )
+    --theBusy;
+  theParticipants.erase( it );
+
+  // the others may have been waiting for this one only
+  AdvanceIfIdle();
+} //}}}
+
+bool SimulatedClock::Idle( int aWakeupFD, boost::int64_t aDeadline ) //{{{
+{
+  boost::lock_guard<boost::mutex> guard( theLock );
+
+  Participants::iterator it = theParticipants.find( aWakeupFD );
+  if( it == theParticipants.end() )
+    return true;
+
+  Participant & participant = it->second;
+  if( participant.theWoken )
+  {
+    participant.theWoken = false;
+    return false;
+  }
+
+  if( !participant.theIdle )
+  {
+    participant.theIdle = true;
+    --theBusy;
+  }
+  participant.theDeadline = aDeadline;
+
+  AdvanceIfIdle();
+
+  return true;
+} //}}}
+
+void SimulatedClock::Busy( int aWakeupFD ) //{{{
+{
+  boost::lock_guard<boost::mutex> guard( theLock );
+
+  Participants::iterator it = theParticipants.find( aWakeupFD );
+  if( it != theParticipants.end() )
+    SetBusy( it->second );
+} //}}}
+
+void SimulatedClock::Wake( int aWakeupFD ) //{{{
+{
+  boost::lock_guard<boost::mutex> guard( theLock );
+
+  Participants::iterator it = theParticipants.find( aWakeupFD );
+  if( it == theParticipants.end() )
+    return;
+
+  it->second.theWoken = true;
+  SetBusy( it->second );
+} //}}}
+
+} // end namespace Event
+
+/* {{{ Modeline for ViM
+ * vim600:fdm=marker fdl=0 fdc=3:
+ * }}} */
@@ -0,0 +1,74 @@
+/*! {{{
+  \file SimulatedClock.h
+
+  \brief Virtual time for deterministic runs
+
+  }}} */
+
+#ifndef SIMULATEDCLOCK_H
+#define SIMULATEDCLOCK_H
+
+#include <boost/cstdint.hpp>
+
+namespace Event
+{
+
+//! \brief time of Clock::SourceSimulated
+//!
+//! Virtual time stands still while any participant is busy and jumps to the
+//! earliest deadline once all of them wait. Every EventProcessor running its
+//! own loop (see ActiveObject) takes part while the source is selected, so
+//! handling an event takes no time and hours of timer behavior pass in the
+//! time the handlers need. Threads that drive a run attach themselves and
+//! wait with Sleep, otherwise the time may move on while they set up.
+//!
+//! Events from threads that do not take part are not accounted for.
+//!
+//! The ProcessorSchedulers and the TimerService read their deadlines from
+//! the clock but sleep in real time, their timers would never fire or spin.
+//! They do not take part: the source cannot be selected while one of them
+//! exists and creating one throws while it is selected.
+class SimulatedClock //{{{
+{
+public:
+  enum { NO_DEADLINE = -1 };
+
+  //! \brief take part with the calling thread, it counts as busy until Sleep or Detach
+  static void Attach();
+  static void Detach();
+
+  //! \brief wait aMilliseconds of virtual time, attaches the thread for the call if needed
+  static void Sleep( unsigned long aMilliseconds );
+
+  //! \brief current virtual time in microseconds
+  static boost::uint64_t Now();
+
+  //! \brief the participant waiting on aWakeupFD (an eventfd) starts and stops taking part
+  static void Join( int aWakeupFD );
+  static void Leave( int aWakeupFD );
+
+  //! \brief the participant waits until aDeadline (microseconds) or an event, NO_DEADLINE for no limit
+  //! the descriptor is written once the time reaches the deadline
+  //! \return false if the participant was woken since its last wait, it has to look for events first
+  static bool Idle( int aWakeupFD, boost::int64_t aDeadline );
+
+  //! \brief the participant stopped waiting
+  static void Busy( int aWakeupFD );
+
+  //! \brief an event was queued for the participant, called by the producer after the push
+  static void Wake( int aWakeupFD );
+
+private:
+  friend class Clock;
+
+  //! \brief virtual time starts from the real one when the source is selected
+  static void SetTime( boost::uint64_t aNow );
+}; //}}}
+
+}
+
+#endif /* ifndef SIMULATEDCLOCK_H */
+
+/* {{{ Modeline for ViM
+ * vim600:fdm=marker fdl=0 fdc=3:
+ * }}} */
@@ -0,0 +1,182 @@
+/*! {{{
+  \file Snapshot.h
+
+  \brief Read-mostly data published as immutable snapshots
+
+  }}} */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/utility.hpp>
+
+#include <vector>
+
+namespace Event
+{
+
+//! \brief holder of an immutable object, replaced as a whole (read-copy-update)
+//!
+//! Readers take no lock: a ReadGuard announces itself in the reader counter
+//! of the current epoch (counters are picked per thread, each stripe on its
+//! own cache line) and then loads the current snapshot. Publish swaps in the
+//! new object and retires the old one without waiting for anybody. The epoch
+//! moves on whenever the readers of the epoch before it are gone, readers of
+//! the current epoch never hold it up. A retired object is deleted by a
+//! later Publish or Synchronize once the epoch moved on twice, no reader can
+//! hold it then. Publish and Synchronize may be called from any thread.
+template<typename T>
+class SnapshotHolder : private boost::noncopyable //{{{
+{
+public:
+  explicit SnapshotHolder( T* aInitial ) : theCurrent( aInitial ), theEpoch( 0 )
+  {
+    for( unsigned int i = 0; i < STRIPES; ++i )
+      for( unsigned int parity = 0; parity < 2; ++parity )
+        theStripes[i].theReaders[parity].store( 0 );
+  }
+
+  ~SnapshotHolder()
+  {
+    for( typename RetiredStorage::iterator it = theRetired.begin(); it != theRetired.end(); ++it )
+      delete it->theSnapshot;
+
+    delete theCurrent.load();
+  }
+
+  class ReadGuard : private boost::noncopyable //{{{
+  {
+  public:
+    explicit ReadGuard( const SnapshotHolder & aHolder )
+    {
+      Stripe & stripe = aHolder.theStripes[StripeIndex()];
+
+      for( ;; )
+      {
+        unsigned int epoch = aHolder.theEpoch.load();
+        theReaders = &stripe.theReaders[epoch & 1];
+        theReaders->fetch_add( 1 );
+
+        // counted while the epoch is still current, so the writer sees us
+        if( aHolder.theEpoch.load() == epoch )
+          break;
+
+        theReaders->fetch_sub( 1, boost::memory_order_release );
+      }
+
+      theSnapshot = aHolder.theCurrent.load();
+    }
+
+    ~ReadGuard() { theReaders->fetch_sub( 1, boost::memory_order_release ); }
+
+    const T & operator*() const { return *theSnapshot; }
+    const T * operator->() const { return theSnapshot; }
+
+  private:
+    boost::atomic<long> * theReaders;
+    const T * theSnapshot;
+  }; //}}}
+
+  //! \brief make aNew the current snapshot, the old one is deleted later
+  void Publish( T* aNew )
+  {
+    boost::lock_guard<boost::mutex> guard( theRetireLock );
+
+    Retired retired = { theCurrent.exchange( aNew ), theEpoch.load() };
+    theRetired.push_back( retired );
+
+    Reclaim();
+  }
+
+  //! \brief return once no reader holds a snapshot replaced before the call
+  void Synchronize()
+  {
+    unsigned int start = theEpoch.load();
+
+    for( ;; )
+    {
+      {
+        boost::lock_guard<boost::mutex> guard( theRetireLock );
+        Reclaim();
+
+        if( theEpoch.load() - start >= 2 )
+          return;
+      }
+
+      boost::this_thread::yield();
+    }
+  }
+
+private:
+  enum { STRIPES = 16, CACHE_LINE = 64 };
+
+  struct Stripe
+  {
+    //! readers that registered in an even and an odd epoch
+    boost::atomic<long> theReaders[2];
+    char thePad[CACHE_LINE - 2 * sizeof( boost::atomic<long> )];
+  };
+
+  struct Retired
+  {
+    T* theSnapshot;
+    //! epoch in which it was replaced
+    unsigned int theEpoch;
+  };
+  typedef std::vector< Retired > RetiredStorage;
+
+  //! threads are spread round robin over the stripes
+  static unsigned int StripeIndex()
+  {
+    static boost::atomic<unsigned int> theNextStripe( 0 );
+    static __thread int theStripe = -1;
+
+    if( theStripe < 0 )
+      theStripe = theNextStripe.fetch_add( 1, boost::memory_order_relaxed ) % STRIPES;
+
+    return theStripe;
+  }
+
+  bool Drained( unsigned int aParity ) const
+  {
+    for( unsigned int i = 0; i < STRIPES; ++i )
+      if( theStripes[i].theReaders[aParity].load() != 0 )
+        return false;
+
+    return true;
+  }
+
+  //! \brief move the epoch on as far as the readers allow and delete what nobody can hold, theRetireLock held
+  void Reclaim()
+  {
+    // readers of the epoch before the current one count with the parity the next one uses
+    for( unsigned int step = 0; step < 2 && Drained( ( theEpoch.load() + 1 ) & 1 ); ++step )
+      theEpoch.fetch_add( 1 );
+
+    typename RetiredStorage::iterator it = theRetired.begin();
+    for( ; it != theRetired.end() && theEpoch.load() - it->theEpoch >= 2; ++it )
+      delete it->theSnapshot;
+
+    theRetired.erase( theRetired.begin(), it );
+  }
+
+  mutable Stripe theStripes[STRIPES];
+  boost::atomic<T*> theCurrent;
+  boost::atomic<unsigned int> theEpoch;
+
+  boost::mutex theRetireLock;
+  //! replaced snapshots, oldest first
+  RetiredStorage theRetired;
+}; //}}}
+
+}
+
+#endif /* ifndef SNAPSHOT_H */
+
+/* {{{ Modeline for ViM
+ * vim600:fdm=marker fdl=0 fdc=3:
+ * }}} */
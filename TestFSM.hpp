@@ -15,24 +15,18 @@ class TestHSM
 public:
   TestHSM();
   ~TestHSM() {};
-  void next( const TopState<TestHSM>& state )
-  {
-    state_ = &state;
-  }
+  inline void next( const TopState<TestHSM>& state );
 
   Signal getSig() const { return sig_; }
 
-  void dispatch(Signal sig)
-  {
-    sig_ = sig;
-    state_->handler(*this);
-  }
+  inline void dispatch(Signal sig);
 
   void foo(int i) { foo_ = i; }
   int foo() const { return foo_; }
 
 private:
   const TopState<TestHSM>* state_;
+  unsigned row_;
   Signal sig_;
   int foo_;
 };
@@ -46,6 +40,8 @@ typedef LeafState<TestHSM,3,S1>       S11;
 typedef CompState<TestHSM,4,S0>     S2;
 typedef CompState<TestHSM,5,S2>       S21;
 typedef LeafState<TestHSM,6,S21>        S211;
+
+typedef TransitionTable<TestHSM,H_SIG+1,S11,S211> TestTable;
 //}}}
 
 //{{{ handle
@@ -167,6 +163,26 @@ template<> inline void S0::init(TestHSM& h)   { Init<S1> i(h);    printf("s0-INI
 template<> inline void Top::init(TestHSM& h)  { Init<S0> i(h);    printf("Top-INIT;"); }
 //}}}
 
+//{{{ dispatch
+// must follow every handle/entry/exit/init specialization, dispatch instantiates TestTable::rows
+inline void TestHSM::next( const TopState<TestHSM>& state )
+{
+  state_ = &state;
+  row_ = TestTable::row( state );
+}
+
+inline void TestHSM::dispatch(Signal sig)
+{
+  sig_ = sig;
+
+  // signals beyond the table and states without a row take the virtual handler
+  if( static_cast<unsigned>( sig ) < TestTable::signals && row_ < TestTable::states )
+    TestTable::dispatch( *this, row_, sig );
+  else
+    state_->handler(*this);
+}
+//}}}
+
 TestHSM::TestHSM()
 {
   foo_ = 0;
@@ -0,0 +1,256 @@
+/*! {{{ File head comment
+  \file TimerService.cpp
+
+  \brief
+
+  }}} */
+
+#include <boost/bind/bind.hpp>
+#include <boost/thread/locks.hpp>
+
+#include <loki/Singleton.h>
+
+#include "TimerService.h"
+#include "Clock.h"
+#include "Debug.h"
+
+namespace Event
+{
+
+typedef Loki::SingletonHolder< TimerService > TimerServiceSingleton;
+
+TimerService & TimerService::Instance() //{{{
+{
+  return TimerServiceSingleton::Instance();
+} //}}}
+
+TimerService::TimerService() //{{{
+  : Clock::RealTimeUser( "TimerService" ), theWheel( Clock::Milliseconds() ), theWaitingUntil( 0 ), theStopping( false ), theDropped( 0 )
+{
+  DEBUG_TRACER;
+
+  boost::thread th( boost::bind( &TimerService::ServiceLoop, this ) );
+  theThread.swap( th );
+} //}}}
+
+TimerService::~TimerService() //{{{
+{
+  DEBUG_TRACER;
+
+  {
+    boost::lock_guard<boost::mutex> guard( theLock );
+    theStopping = true;
+    theCondition.notify_one();
+  }
+
+  theThread.join();
+} //}}}
+
+TimerHandle TimerService::StartTimer( unsigned int aProcessorID, unsigned long aDelay, const EventPointer & aEvent /*= EventPointer()*/ ) //{{{
+{
+  DEBUG_TRACER;
+
+  return PushTimer( aProcessorID, aDelay, false, aEvent );
+} //}}}
+
+TimerHandle TimerService::StartZyclicTimer( unsigned int aProcessorID, unsigned long aDelay, const EventPointer & aEvent /*= EventPointer()*/ ) //{{{
+{
+  DEBUG_TRACER;
+
+  // a zero period would expire again and again
+  return PushTimer( aProcessorID, aDelay ? aDelay : 1, true, aEvent );
+} //}}}
+
+TimerHandle TimerService::PushTimer( unsigned int aProcessorID, unsigned long aDelay, bool aCyclic, const EventPointer & aEvent ) //{{{
+{
+  boost::lock_guard<boost::mutex> guard( theLock );
+
+  unsigned int slot;
+  if( !theFreeSlots.empty() )
+  {
+    slot = theFreeSlots.back();
+    theFreeSlots.pop_back();
+  }
+  else
+  {
+    slot = theSlots.size();
+    theSlots.push_back( TimerStorage() );
+  }
+
+  TimerStorage & timer = theSlots[slot];
+  TimerHandle handle( slot, timer.theGeneration );
+
+  // the current millisecond has partly passed, round up so no timer expires early
+  TimerWheel::Tick expiry = Clock::Milliseconds() + aDelay + 1;
+
+  timer.theNode = theWheel.Add( expiry, slot );
+  timer.theUsed = true;
+  timer.theCyclic = aCyclic;
+  timer.theProcessorID = aProcessorID;
+  timer.theDelay = aDelay;
+  timer.theEvent = aEvent ? aEvent : EventPointer( new PayloadEvent( TIMER_HANDLE_ELAPSED, handle ) );
+
+  if( !theWaitingUntil || expiry < theWaitingUntil )
+    theCondition.notify_one();
+
+  return handle;
+} //}}}
+
+void TimerService::StopTimer( const TimerHandle & aTimer ) //{{{
+{
+  DEBUG_TRACER;
+
+  boost::lock_guard<boost::mutex> guard( theLock );
+
+  if( aTimer.theSlot >= theSlots.size() )
+    return;
+
+  TimerStorage & timer = theSlots[aTimer.theSlot];
+  if( !timer.theUsed || timer.theGeneration != aTimer.theGeneration )
+    return;
+
+  // a later deadline of the service thread only costs it one early wakeup
+  theWheel.Remove( timer.theNode );
+  ReleaseSlot( aTimer.theSlot );
+} //}}}
+
+bool TimerService::IsTimerActive( const TimerHandle & aTimer ) const //{{{
+{
+  boost::lock_guard<boost::mutex> guard( theLock );
+
+  return aTimer.theSlot < theSlots.size()
+    && theSlots[aTimer.theSlot].theUsed
+    && theSlots[aTimer.theSlot].theGeneration == aTimer.theGeneration;
+} //}}}
+
+void TimerService::ReleaseSlot( unsigned int aSlot ) //{{{
+{
+  TimerStorage & timer = theSlots[aSlot];
+
+  // outdates every handle of the timer
+  ++timer.theGeneration;
+  timer.theUsed = false;
+  timer.theEvent.reset();
+
+  theFreeSlots.push_back( aSlot );
+} //}}}
+
+void TimerService::Post( const Expiry & aExpiry, std::vector< Expiry > & aRetries ) //{{{
+{
+  switch( TrySendEventTo( aExpiry.theProcessorID, aExpiry.theEvent ) )
+  {
+    case SendQueued:
+      return;
+
+    case SendDropped:
+      ++theDropped;
+      return;
+
+    case SendFull:
+      // a cyclic timer waits with one period at most
+      for( std::vector< Expiry >::const_iterator it = aRetries.begin(); it != aRetries.end(); ++it )
+        if( it->theTimer == aExpiry.theTimer )
+        {
+          ++theDropped;
+          return;
+        }
+
+      aRetries.push_back( aExpiry );
+      return;
+
+    case SendNoProcessor:
+      DBGOUT_DEBUG( Debug::Prefix() << "TimerService: no processor " << aExpiry.theProcessorID << ", timer stopped\n" );
+      StopTimer( aExpiry.theTimer );
+      return;
+  }
+} //}}}
+
+void TimerService::ServiceLoop() //{{{
+{
+  DEBUG_TRACER;
+
+  std::vector< Expiry > expired;
+  // expiries that found an OverflowBlock mailbox full, oldest first
+  std::vector< Expiry > retries;
+
+  boost::unique_lock<boost::mutex> lock( theLock );
+
+  while( !theStopping )
+  {
+    TimerWheel::Tick now = Clock::Milliseconds();
+    theWheel.Advance( now );
+
+    unsigned long slot;
+    TimerWheel::Tick expiry;
+    while( theWheel.PopExpired( slot, expiry ) )
+    {
+      TimerStorage & timer = theSlots[slot];
+
+      Expiry posted;
+      posted.theTimer = TimerHandle( slot, timer.theGeneration );
+      posted.theProcessorID = timer.theProcessorID;
+      posted.theEvent = timer.theEvent;
+      expired.push_back( posted );
+
+      if( timer.theCyclic )
+      {
+        TimerWheel::Tick next = expiry + timer.theDelay;
+        // as in TimerSystem a period due exactly now is not missed
+        if( next < now )
+          next += ( ( now - next - 1 ) / timer.theDelay + 1 ) * timer.theDelay;
+
+        timer.theNode = theWheel.Add( next, slot );
+      }
+      else
+        ReleaseSlot( slot );
+    }
+
+    if( !expired.empty() || !retries.empty() )
+    {
+      // timers are started and stopped while posting
+      lock.unlock();
+
+      bool retrying = expired.empty();
+
+      // earlier expiries first
+      expired.insert( expired.begin(), retries.begin(), retries.end() );
+      retries.clear();
+
+      for( std::vector< Expiry >::const_iterator it = expired.begin(); it != expired.end(); ++it )
+        Post( *it, retries );
+
+      expired.clear();
+
+      lock.lock();
+
+      // new expiries may be due already, retries wait for the consumers to make room
+      if( !retrying )
+        continue;
+    }
+
+    TimerWheel::Tick next;
+    bool timed = theWheel.NextExpiry( next );
+    if( !retries.empty() && ( !timed || next > now + RETRY_DELAY ) )
+    {
+      next = now + RETRY_DELAY;
+      timed = true;
+    }
+
+    if( timed )
+    {
+      theWaitingUntil = next;
+      theCondition.timed_wait( lock, boost::posix_time::milliseconds( next - now ) );
+    }
+    else
+    {
+      theWaitingUntil = 0;
+      theCondition.wait( lock );
+    }
+  }
+} //}}}
+
+} // end namespace Event
+
+/* {{{ Modeline for ViM
+ * vim600:fdm=marker fdl=0 fdc=3:
+ * }}} */
@@ -0,0 +1,113 @@
+/*! {{{
+  \file TimerService.h
+
+  \brief
+
+  }}} */
+
+#ifndef TIMERSERVICE_H
+#define TIMERSERVICE_H
+
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+
+#include <vector>
+
+#include "Event.h"
+#include "TimerWheel.h"
+
+namespace Event
+{
+
+//! \brief one timer wheel and thread for all processors
+//!
+//! An alternative to the TimerSystem every EventProcessor has: the service
+//! keeps the timers of all processors on one wheel and posts an expiry as
+//! an event to the owning processor with SendEventTo. A processor that only
+//! uses the service allocates no timer storage of its own and waits for
+//! events without a timeout. The methods may be called from any thread.
+//!
+//! The service thread never waits for a processor: an expiry that finds an
+//! OverflowBlock mailbox full is posted again a millisecond later, one the
+//! overflow policy discards is counted by GetDropped.
+//!
+//! The thread sleeps in real time until deadlines of the Clock, so the
+//! service refuses Clock::SourceSimulated.
+class TimerService : private boost::noncopyable, private Clock::RealTimeUser //{{{
+{
+public:
+  //! \brief the process wide service
+  static TimerService & Instance();
+
+  TimerService();
+  ~TimerService();
+
+  //! \brief post aEvent to the processor with GetID() == aProcessorID after aDelay ms
+  //! without aEvent a PayloadEvent TIMER_HANDLE_ELAPSED carrying the handle is posted
+  TimerHandle StartTimer( unsigned int aProcessorID, unsigned long aDelay, const EventPointer & aEvent = EventPointer() );
+
+  //! \brief every period counts from the previous deadline, periods missed are skipped
+  //! the timer stops by itself once no processor has aProcessorID
+  TimerHandle StartZyclicTimer( unsigned int aProcessorID, unsigned long aDelay, const EventPointer & aEvent = EventPointer() );
+
+  //! \brief an expiry that is just being posted or waits for room is still delivered
+  void StopTimer( const TimerHandle & aTimer );
+
+  bool IsTimerActive( const TimerHandle & aTimer ) const;
+
+  //! \brief expiries the processors discarded, and periods that expired while the previous one waited for room
+  unsigned long GetDropped() const { return theDropped.load(); }
+
+private:
+  //! ms until an expiry is posted again to a full mailbox
+  enum { RETRY_DELAY = 1 };
+
+  struct TimerStorage //{{{
+  {
+    TimerStorage() : theNode( TimerWheel::INVALID_HANDLE ), theGeneration( 0 ), theUsed( false ), theCyclic( false ), theProcessorID( 0 ), theDelay( 0 ) {}
+
+    TimerWheel::Handle theNode;
+    unsigned int theGeneration;
+    bool theUsed;
+    bool theCyclic;
+    unsigned int theProcessorID;
+    unsigned long theDelay;
+    //! posted on every expiry, no allocation per period
+    EventPointer theEvent;
+  }; //}}}
+
+  struct Expiry //{{{
+  {
+    TimerHandle theTimer;
+    unsigned int theProcessorID;
+    EventPointer theEvent;
+  }; //}}}
+
+  TimerHandle PushTimer( unsigned int aProcessorID, unsigned long aDelay, bool aCyclic, const EventPointer & aEvent );
+  void ReleaseSlot( unsigned int aSlot );
+  void ServiceLoop();
+  //! \brief post without the lock, an expiry finding the mailbox full is added to aRetries
+  void Post( const Expiry & aExpiry, std::vector< Expiry > & aRetries );
+
+  TimerWheel theWheel;
+  std::vector< TimerStorage > theSlots;
+  std::vector< unsigned int > theFreeSlots;
+
+  mutable boost::mutex theLock;
+  boost::condition_variable theCondition;
+  //! deadline the service thread sleeps until, 0 if it waits for the first timer
+  TimerWheel::Tick theWaitingUntil;
+  bool theStopping;
+
+  boost::atomic<unsigned long> theDropped;
+
+  boost::thread theThread;
+}; //}}}
+
+}
+
+#endif /* ifndef TIMERSERVICE_H */
+
+/* {{{ Modeline for ViM
+ * vim600:fdm=marker fdl=0 fdc=3:
+ * }}} */
@@ -5,96 +5,342 @@
 
  }}} */
 
+#include <stdexcept>
+#include <vector>
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+
 #include "TimerSystem.h"
 #include "Debug.h"
 
-#include <boost/lambda/lambda.hpp>
-#include <boost/lambda/bind.hpp>
+namespace Event
+{
 
-using namespace boost::posix_time;
-using namespace boost::lambda;
+//! \brief allocated with the first timer, processors without timers do not pay for the wheel
+struct TimerSystem::TimerTable //{{{
+{
+  explicit TimerTable( TimerWheel::Tick aNow ) : theWheel( aNow ) {}
 
-namespace Event
+  TimerWheel theWheel;
+
+  //! grows with the number of timers, released slots are reused
+  std::vector< TimerStorage > theSlots;
+  std::vector< unsigned int > theFreeSlots;
+
+  //! the timers started by ID
+  TimerHandle theTimerIDs[TIMER_IDS];
+}; //}}}
+
+TimerSystem::TimerSystem(): theNow( Clock::Microseconds() ), theSlack( 0 ), theTimerFD( -1 ), theArmedExpiry( 0 ), theTable( 0 )
 {
 
-TimerSystem::TimerSystem(): theTimerQueue( TIMERQ_MAX_SIZE ), thePausedTimerQueue( TIMERQ_MAX_SIZE )
+}
+
+TimerSystem::~TimerSystem()
 {
+  delete theTable;
 
+  if( theTimerFD >= 0 )
+    close( theTimerFD );
 }
 
+TimerSystem::TimerTable & TimerSystem::Table() //{{{
+{
+  if( !theTable )
+    theTable = new TimerTable( Now() );
+
+  return *theTable;
+} //}}}
+
+bool TimerSystem::EnableTimerFD() //{{{
+{
+  DEBUG_TRACER;
+
+  if( theTimerFD >= 0 )
+    return true;
+
+  // Clock counts from the start of CLOCK_MONOTONIC, wheel ticks are absolute times of it
+  theTimerFD = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+  if( theTimerFD < 0 )
+  {
+    DBGOUT_WARNING( Debug::Prefix() << "Could not create timerfd, using poll timeouts\n" );
+    return false;
+  }
+
+  theArmedExpiry = 0;
+  return true;
+} //}}}
+
+bool TimerSystem::ArmTimerFD() //{{{
+{
+  if( theTimerFD < 0 )
+    return false;
+
+  bool monotonic = Clock::GetSource() == Clock::SourceMonotonic;
+
+  TimerWheel::Tick expiry = 0;
+  if( monotonic && theTable && !theTable->theWheel.HasExpired() )
+    theTable->theWheel.NextExpiry( expiry );
+
+  if( expiry == theArmedExpiry )
+    return monotonic;
+
+  itimerspec spec;
+  spec.it_interval.tv_sec = 0;
+  spec.it_interval.tv_nsec = 0;
+  spec.it_value.tv_sec = expiry / 1000000;
+  spec.it_value.tv_nsec = ( expiry % 1000000 ) * 1000;
+
+  // an all zero it_value disarms
+  if( -1 == timerfd_settime( theTimerFD, TFD_TIMER_ABSTIME, &spec, 0 ) )
+  {
+    DBGOUT_FATAL( Debug::Prefix() << "Could not arm timerfd\n" );
+    throw std::runtime_error( "TimerSystem: Could not arm timerfd" );
+  }
+
+  theArmedExpiry = expiry;
+  return monotonic;
+} //}}}
+
+void TimerSystem::AcknowledgeTimerFD() //{{{
+{
+  uint64_t expirations;
+  if( -1 == read( theTimerFD, &expirations, sizeof( expirations ) ) && errno != EAGAIN )
+  {
+    DBGOUT_FATAL( Debug::Prefix() << "Could not read from timerfd\n" );
+    throw std::runtime_error( "TimerSystem: Could not read from timerfd" );
+  }
+
+  // one shot, it is disarmed now
+  theArmedExpiry = 0;
+} //}}}
+
+TimerWheel::Tick TimerSystem::Deadline( TimerWheel::Tick aDelay ) const //{{{
+{
+  // the current microsecond has partly passed, round up so no timer expires early
+  return Now() + aDelay + 1;
+} //}}}
+
+void TimerSystem::Schedule( TimerStorage & aTimer, unsigned int aSlot ) //{{{
+{
+  TimerWheel::Tick expiry = aTimer.theDeadline;
+
+  if( aTimer.theSlack > 1 )
+  {
+    // multiples of a power of two are the same points in time for every processor
+    TimerWheel::Tick grid = 1ULL << ( 63 - __builtin_clzll( aTimer.theSlack ) );
+    expiry = ( expiry + grid - 1 ) & ~( grid - 1 );
+  }
+
+  aTimer.theNode = theTable->theWheel.Add( expiry, aSlot );
+} //}}}
+
+TimerWheel::Tick TimerSystem::Ticks( const boost::posix_time::time_duration & aDelay ) //{{{
+{
+  return aDelay.is_negative() ? 0 : aDelay.total_microseconds();
+} //}}}
+
 void TimerSystem::StartTimer( unsigned char aID, unsigned long aDelay ) //{{{
 {
   DEBUG_TRACER;
 
   StopTimer( aID );
 
-  PushTimer( TimerStorage( aID, microsec_clock::local_time() + millisec( aDelay ), aDelay, false ) );
+  Table().theTimerIDs[aID] = PushTimer( aID, Ticks( aDelay ), false, CatchUpSkip );
 } //}}}
 
-void TimerSystem::StartZyclicTimer( unsigned char aID, unsigned long aDelay ) //{{{
+void TimerSystem::StartZyclicTimer( unsigned char aID, unsigned long aDelay, CatchUpPolicy aPolicy /*= CatchUpSkip*/ ) //{{{
 {
   DEBUG_TRACER;
 
   StopTimer( aID );
 
-  PushTimer( TimerStorage( aID, microsec_clock::local_time() + millisec( aDelay ), aDelay, true ) );
+  Table().theTimerIDs[aID] = PushTimer( aID, Ticks( aDelay ), true, aPolicy );
 } //}}}
 
-void TimerSystem::PushTimer( const TimerStorage & aTimer ) //{{{
+void TimerSystem::StopTimer( unsigned char aID ) //{{{
 {
   DEBUG_TRACER;
 
-  Assert( !theTimerQueue.full() );
+  if( theTable )
+    StopTimer( theTable->theTimerIDs[aID] );
+} //}}}
+
+bool TimerSystem::PauseTimer( unsigned char aID ) //{{{
+{
+  DEBUG_TRACER;
+
+  return theTable && PauseTimer( theTable->theTimerIDs[aID] );
+} //}}}
+
+bool TimerSystem::ContinueTimer( unsigned char aID ) //{{{
+{
+  DEBUG_TRACER;
+
+  return theTable && ContinueTimer( theTable->theTimerIDs[aID] );
+} //}}}
+
+bool TimerSystem::IsTimerActive( unsigned char aID ) //{{{
+{
+  DEBUG_TRACER;
+
+  return theTable && IsTimerActive( theTable->theTimerIDs[aID] );
+} //}}}
+
+bool TimerSystem::IsTimerPaused( unsigned char aID ) //{{{
+{
+  DEBUG_TRACER;
+
+  return theTable && IsTimerPaused( theTable->theTimerIDs[aID] );
+} //}}}
+
+TimerHandle TimerSystem::StartTimer( unsigned long aDelay ) //{{{
+{
+  DEBUG_TRACER;
+
+  return PushTimer( -1, Ticks( aDelay ), false, CatchUpSkip );
+} //}}}
 
-  if( theTimerQueue.empty() )
+TimerHandle TimerSystem::StartZyclicTimer( unsigned long aDelay, CatchUpPolicy aPolicy ) //{{{
+{
+  DEBUG_TRACER;
+
+  return PushTimer( -1, Ticks( aDelay ), true, aPolicy );
+} //}}}
+
+void TimerSystem::StartTimer( unsigned char aID, const boost::posix_time::time_duration & aDelay ) //{{{
+{
+  DEBUG_TRACER;
+
+  StopTimer( aID );
+
+  Table().theTimerIDs[aID] = PushTimer( aID, Ticks( aDelay ), false, CatchUpSkip );
+} //}}}
+
+void TimerSystem::StartZyclicTimer( unsigned char aID, const boost::posix_time::time_duration & aDelay, CatchUpPolicy aPolicy /*= CatchUpSkip*/ ) //{{{
+{
+  DEBUG_TRACER;
+
+  StopTimer( aID );
+
+  Table().theTimerIDs[aID] = PushTimer( aID, Ticks( aDelay ), true, aPolicy );
+} //}}}
+
+TimerHandle TimerSystem::StartTimer( const boost::posix_time::time_duration & aDelay ) //{{{
+{
+  DEBUG_TRACER;
+
+  return PushTimer( -1, Ticks( aDelay ), false, CatchUpSkip );
+} //}}}
+
+TimerHandle TimerSystem::StartZyclicTimer( const boost::posix_time::time_duration & aDelay, CatchUpPolicy aPolicy ) //{{{
+{
+  DEBUG_TRACER;
+
+  return PushTimer( -1, Ticks( aDelay ), true, aPolicy );
+} //}}}
+
+TimerHandle TimerSystem::PushTimer( int aID, TimerWheel::Tick aDelay, bool aCyclic, CatchUpPolicy aPolicy, const boost::intrusive_ptr<RefCounted> & aEvent /*= boost::intrusive_ptr<RefCounted>()*/ ) //{{{
+{
+  DEBUG_TRACER;
+
+  // a zero period would expire again and again within one batch
+  if( aCyclic && !aDelay )
+    aDelay = 1;
+
+  TimerTable & table = Table();
+
+  unsigned int slot;
+  if( !table.theFreeSlots.empty() )
   {
-    theTimerQueue.push_back( aTimer );
+    slot = table.theFreeSlots.back();
+    table.theFreeSlots.pop_back();
   }
   else
   {
-    boost::circular_buffer< TimerStorage >::iterator pos =
-      std::upper_bound( theTimerQueue.begin(), theTimerQueue.end() , aTimer );
-
-    theTimerQueue.insert( pos, aTimer );
+    slot = table.theSlots.size();
+    table.theSlots.push_back( TimerStorage() );
   }
+
+  TimerStorage & timer = table.theSlots[slot];
+
+  timer.theDeadline = Deadline( aDelay );
+  timer.theSlack = theSlack;
+  Schedule( timer, slot );
+  timer.theUsed = true;
+  timer.theActive = true;
+  timer.thePaused = false;
+  timer.theCyclic = aCyclic;
+  timer.theCatchUp = aPolicy;
+  timer.theID = aID;
+  timer.theDelay = aDelay;
+  timer.theEvent = aEvent;
+
+  return TimerHandle( slot, timer.theGeneration );
 } //}}}
 
-void TimerSystem::StopTimer( unsigned char aID ) //{{{
+void TimerSystem::ReleaseSlot( unsigned int aSlot ) //{{{
+{
+  TimerStorage & timer = theTable->theSlots[aSlot];
+
+  // outdates every handle of the timer
+  ++timer.theGeneration;
+  timer.theEvent.reset();
+  timer.theUsed = false;
+  timer.theActive = false;
+  timer.thePaused = false;
+
+  theTable->theFreeSlots.push_back( aSlot );
+} //}}}
+
+TimerSystem::TimerStorage* TimerSystem::Find( const TimerHandle & aTimer ) //{{{
+{
+  if( !theTable || aTimer.theSlot >= theTable->theSlots.size() )
+    return 0;
+
+  TimerStorage & timer = theTable->theSlots[aTimer.theSlot];
+
+  return timer.theUsed && timer.theGeneration == aTimer.theGeneration ? &timer : 0;
+} //}}}
+
+const TimerSystem::TimerStorage* TimerSystem::Find( const TimerHandle & aTimer ) const //{{{
+{
+  return const_cast<TimerSystem*>( this )->Find( aTimer );
+} //}}}
+
+void TimerSystem::StopTimer( const TimerHandle & aTimer ) //{{{
 {
   DEBUG_TRACER;
 
-  boost::circular_buffer< TimerStorage >::iterator it = std::find_if( theTimerQueue.begin(), theTimerQueue.end(),
-    bind( &TimerStorage::theID, boost::lambda::_1 ) == aID );
+  TimerStorage* timer = Find( aTimer );
+  if( !timer )
+    return;
 
-  if( it != theTimerQueue.end() )
-  {
-    DBGOUT_DEBUG( Debug::Prefix() << "StopTimer with id " << static_cast<int>( aID ) << std::endl );
-    theTimerQueue.erase( it );
-  }
+  DBGOUT_DEBUG( Debug::Prefix() << "StopTimer in slot " << aTimer.theSlot << std::endl );
 
-  boost::circular_buffer< TimerStorage >::iterator pit = std::find_if( thePausedTimerQueue.begin(), thePausedTimerQueue.end(),
-    bind( &TimerStorage::theID, boost::lambda::_1 ) == aID );
+  if( timer->theActive )
+    theTable->theWheel.Remove( timer->theNode );
 
-  if( pit != thePausedTimerQueue.end() )
-  {
-    thePausedTimerQueue.erase( pit );
-  }
+  ReleaseSlot( aTimer.theSlot );
 } //}}}
 
-bool TimerSystem::PauseTimer( unsigned char aID ) //{{{
+bool TimerSystem::PauseTimer( const TimerHandle & aTimer ) //{{{
 {
   DEBUG_TRACER;
 
-  boost::circular_buffer< TimerStorage >::iterator it = std::find_if( theTimerQueue.begin(), theTimerQueue.end(),
-    bind( &TimerStorage::theID, boost::lambda::_1 ) == aID );
+  TimerStorage* timer = Find( aTimer );
 
-  if( it != theTimerQueue.end() )
+  if( timer && timer->theActive )
   {
-    time_duration timeToActivate = it->theTime - microsec_clock::local_time();
-    it->theMillisecondsToActivate = timeToActivate.total_milliseconds();
+    TimerWheel::Tick now = Now();
+    timer->theTimeToActivate = timer->theDeadline > now ? timer->theDeadline - now : 0;
 
-    thePausedTimerQueue.push_back( *it );
-    theTimerQueue.erase( it );
+    theTable->theWheel.Remove( timer->theNode );
+    timer->theActive = false;
+    timer->thePaused = true;
 
     return true;
   }
@@ -102,19 +348,18 @@ bool TimerSystem::PauseTimer( unsigned char aID ) //{{{
   return false;
 } //}}}
 
-bool TimerSystem::ContinueTimer( unsigned char aID ) //{{{
+bool TimerSystem::ContinueTimer( const TimerHandle & aTimer ) //{{{
 {
   DEBUG_TRACER;
 
-  boost::circular_buffer< TimerStorage >::iterator it = std::find_if( thePausedTimerQueue.begin(), thePausedTimerQueue.end(),
-    bind( &TimerStorage::theID, boost::lambda::_1 ) == aID );
+  TimerStorage* timer = Find( aTimer );
 
-  if( it != thePausedTimerQueue.end() )
+  if( timer && timer->thePaused )
   {
-    it->theTime = microsec_clock::local_time() + millisec( it->theMillisecondsToActivate );
-
-    PushTimer( *it );
-    thePausedTimerQueue.erase( it );
+    timer->theDeadline = Now() + timer->theTimeToActivate;
+    Schedule( *timer, aTimer.theSlot );
+    timer->theActive = true;
+    timer->thePaused = false;
 
     return true;
   }
@@ -122,70 +367,104 @@ bool TimerSystem::ContinueTimer( unsigned char aID ) //{{{
   return false;
 } //}}}
 
-bool TimerSystem::IsTimerActive( unsigned char aID ) //{{{
+bool TimerSystem::IsTimerActive( const TimerHandle & aTimer ) const //{{{
 {
-  DEBUG_TRACER;
+  const TimerStorage* timer = Find( aTimer );
 
-  boost::circular_buffer< TimerStorage >::const_iterator it = std::find_if( theTimerQueue.begin(), theTimerQueue.end(),
-    bind( &TimerStorage::theID, boost::lambda::_1 ) == aID );
-
-  return ( it != theTimerQueue.end() );
+  return timer && timer->theActive;
 } //}}}
 
-bool TimerSystem::IsTimerPaused( unsigned char aID ) //{{{
+bool TimerSystem::IsTimerPaused( const TimerHandle & aTimer ) const //{{{
 {
-  DEBUG_TRACER;
+  const TimerStorage* timer = Find( aTimer );
 
-  boost::circular_buffer< TimerStorage >::const_iterator it = std::find_if( thePausedTimerQueue.begin(), thePausedTimerQueue.end(),
-    bind( &TimerStorage::theID, boost::lambda::_1 ) == aID );
-
-  return ( it != thePausedTimerQueue.end() );
+  return timer && timer->thePaused;
 } //}}}
 
 std::pair<bool,long int> TimerSystem::GetMaxWaitTime() const //{{{
 {
   DEBUG_TRACER;
 
-  if( theTimerQueue.empty() )
+  std::pair<bool,TimerWheel::Tick> expiry = GetNextExpiry();
+  if( !expiry.first )
     return std::make_pair( false, 0L );
 
-  time_duration timeToActivate = theTimerQueue.front().theTime - microsec_clock::local_time();
-
-  long milliseconds = timeToActivate.total_milliseconds();
+  TimerWheel::Tick now = Now();
 
-  if( milliseconds <= 0 )
+  if( expiry.second <= now )
     return std::make_pair( true, 0L );
 
-  return std::make_pair( true, milliseconds );
+  return std::make_pair( true, static_cast<long>( expiry.second - now ) );
 } //}}}
 
-std::pair<bool,unsigned char> TimerSystem::GetNextTimer() //{{{
+std::pair<bool,TimerWheel::Tick> TimerSystem::GetNextExpiry() const //{{{
 {
-  DEBUG_TRACER;
+  if( !theTable )
+    return std::make_pair( false, TimerWheel::Tick( 0 ) );
+
+  if( theTable->theWheel.HasExpired() )
+    return std::make_pair( true, Now() );
+
+  TimerWheel::Tick expiry;
+  if( !theTable->theWheel.NextExpiry( expiry ) )
+    return std::make_pair( false, TimerWheel::Tick( 0 ) );
 
-  if( theTimerQueue.empty() )
+  return std::make_pair( true, expiry );
+} //}}}
+
+bool TimerSystem::CollectExpiredTimers() //{{{
+{
+  if( !theTable )
+    return false;
+
+  theTable->theWheel.Advance( Now() );
+
+  return theTable->theWheel.HasExpired();
+} //}}}
+
+bool TimerSystem::PopExpiredTimer( ExpiredTimer & aTimer ) //{{{
+{
+  unsigned long slot;
+  TimerWheel::Tick expiry;
+  if( !theTable || !theTable->theWheel.PopExpired( slot, expiry ) )
   {
-    DBGOUT_DEBUG( Debug::Prefix() << "TimerSystem::GetNextTimer queue empty " << std::endl );
-    return std::make_pair( false, 0 );
+    DBGOUT_DEBUG( Debug::Prefix() << "TimerSystem::PopExpiredTimer no timer expired " << std::endl );
+    return false;
   }
 
-  std::pair<bool,long int> needWait = GetMaxWaitTime();
-  if( needWait.first && needWait.second == 0 )
+  TimerStorage & timer = theTable->theSlots[slot];
+
+  aTimer.theHandle = TimerHandle( slot, timer.theGeneration );
+  aTimer.theID = timer.theID;
+  aTimer.theOverruns = 0;
+
+  if( !timer.theCyclic )
+  {
+    aTimer.theEvent.swap( timer.theEvent );
+    ReleaseSlot( slot );
+    return true;
+  }
+
+  // shared with the next periods, only the reference count changes
+  aTimer.theEvent = timer.theEvent;
+
+  TimerWheel::Tick next = timer.theDeadline + timer.theDelay;
+
+  // a period due exactly now is not missed, it expires in this batch
+  if( next < Now() && timer.theCatchUp != CatchUpBurst )
   {
-    unsigned char id = theTimerQueue.front().theID;
-    if( theTimerQueue.front().theCyclic )
-    {
-      unsigned long delay = theTimerQueue.front().theDelay;
-      theTimerQueue.pop_front();
-      StartZyclicTimer( id, delay );
-    }
-    else
-      theTimerQueue.pop_front();
-
-    return std::make_pair( true, id );
+    unsigned long missed = ( Now() - next - 1 ) / timer.theDelay + 1;
+    next += missed * timer.theDelay;
+
+    if( timer.theCatchUp == CatchUpReportOverrun )
+      aTimer.theOverruns = missed;
   }
 
-  return std::make_pair( false, 0 );
+  // a missed deadline of CatchUpBurst is expired at once and handed out in the same batch
+  timer.theDeadline = next;
+  Schedule( timer, slot );
+
+  return true;
 } //}}}
 
 
@@ -8,22 +8,56 @@
 #ifndef TIMERSYSTEM_H
 #define TIMERSYSTEM_H
 
-#include <boost/circular_buffer.hpp>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/intrusive_ptr.hpp>
+
+#include <utility>
+
+#include "Clock.h"
+#include "RefCounted.h"
+#include "TimerWheel.h"
 
 namespace Event
 {
 
+class Event;
+
+//! \brief names one timer started by TimerSystem, stays valid until the timer is stopped or expired
+//!
+//! The slot is an index into the timer table, the generation tells a timer
+//! apart from later ones reusing the slot, so an outdated handle is harmless.
+struct TimerHandle //{{{
+{
+  TimerHandle() : theSlot( ~0u ), theGeneration( 0 ) {}
+  TimerHandle( unsigned int aSlot, unsigned int aGeneration ) : theSlot( aSlot ), theGeneration( aGeneration ) {}
+
+  bool operator==( const TimerHandle & other ) const { return theSlot == other.theSlot && theGeneration == other.theGeneration; }
+  bool operator!=( const TimerHandle & other ) const { return !( *this == other ); }
+
+  unsigned int theSlot;
+  unsigned int theGeneration;
+}; //}}}
+
 class TimerSystem
 {
 public:
   TimerSystem();
+  ~TimerSystem();
 
 protected:
-  enum { TIMERQ_MAX_SIZE = 256 };
+  //! \brief what a cyclic timer does about periods missed while the processor was busy
+  enum CatchUpPolicy
+  {
+    CatchUpSkip,          //!< drop missed periods, keep the phase
+    CatchUpBurst,         //!< deliver every missed period at once
+    CatchUpReportOverrun  //!< drop missed periods, their number is the Param of the next expiry event
+  };
 
+  //! \brief timers named by the caller, they expire as TIMER_ELAPSED( aID )
   void StartTimer( unsigned char aID, unsigned long aDelay );
-  void StartZyclicTimer( unsigned char aID, unsigned long aDelay );
+
+  //! \brief every period counts from the previous deadline, handling time does not add up
+  void StartZyclicTimer( unsigned char aID, unsigned long aDelay, CatchUpPolicy aPolicy = CatchUpSkip );
 
   void StopTimer( unsigned char aID );
   bool PauseTimer( unsigned char aID );
@@ -32,36 +66,140 @@ protected:
   bool IsTimerActive( unsigned char aID );
   bool IsTimerPaused( unsigned char aID );
 
+  //! \brief timers without a limit on their number, they expire as a PayloadEvent
+  //! TIMER_HANDLE_ELAPSED carrying the TimerHandle
+  TimerHandle StartTimer( unsigned long aDelay );
+  TimerHandle StartZyclicTimer( unsigned long aDelay, CatchUpPolicy aPolicy );
+
+  //! \brief timers delivering aEvent itself on expiry, e.g. a PayloadEvent with the handler's context
+  //! the event is shared by all periods of a cyclic timer, nothing is allocated per expiry;
+  //! it carries no overrun count. Defined with the events in Event.cpp
+  TimerHandle StartTimer( unsigned long aDelay, const boost::intrusive_ptr<Event> & aEvent );
+  TimerHandle StartZyclicTimer( unsigned long aDelay, const boost::intrusive_ptr<Event> & aEvent, CatchUpPolicy aPolicy = CatchUpSkip );
+
+  void StopTimer( const TimerHandle & aTimer );
+  bool PauseTimer( const TimerHandle & aTimer );
+  bool ContinueTimer( const TimerHandle & aTimer );
+
+  bool IsTimerActive( const TimerHandle & aTimer ) const;
+  bool IsTimerPaused( const TimerHandle & aTimer ) const;
+
+  //! \brief the above with a delay of microsecond resolution, e.g. boost::posix_time::microseconds( 250 )
+  //! the delays in unsigned long are milliseconds
+  void StartTimer( unsigned char aID, const boost::posix_time::time_duration & aDelay );
+  void StartZyclicTimer( unsigned char aID, const boost::posix_time::time_duration & aDelay, CatchUpPolicy aPolicy = CatchUpSkip );
+  TimerHandle StartTimer( const boost::posix_time::time_duration & aDelay );
+  TimerHandle StartZyclicTimer( const boost::posix_time::time_duration & aDelay, CatchUpPolicy aPolicy );
+  TimerHandle StartTimer( const boost::posix_time::time_duration & aDelay, const boost::intrusive_ptr<Event> & aEvent );
+  TimerHandle StartZyclicTimer( const boost::posix_time::time_duration & aDelay, const boost::intrusive_ptr<Event> & aEvent, CatchUpPolicy aPolicy = CatchUpSkip );
+
+  //! \brief timers started from now on may expire up to aSlack late, 0 (the default) for exact expiry
+  //! a timer is moved to the next multiple of the largest power of two within its slack, so
+  //! timers with a similar slack expire together, in this processor and in all others
+  void SetTimerSlack( const boost::posix_time::time_duration & aSlack ) { theSlack = Ticks( aSlack ); }
+  boost::posix_time::time_duration GetTimerSlack() const { return boost::posix_time::microseconds( theSlack ); }
+
+  //! \brief read the clock, all timer calls until the next UpdateTime use this time
+  //! EventProcessor::Run calls it once per loop iteration, after waiting for events
+  void UpdateTime() { theNow = Clock::Microseconds(); }
+
+  //! \brief wake the event loop with a timerfd at the earliest deadline instead of a poll timeout
+  //! \return false if no timerfd could be created, the poll timeout is used then
+  bool EnableTimerFD();
+
+  //! \brief -1 if EnableTimerFD was not called
+  int GetTimerFD() const { return theTimerFD; }
+
+  //! \brief arm the timerfd to the earliest deadline, before waiting; a system call only if it changed
+  //! the deadline is a time of CLOCK_MONOTONIC with Clock::SourceMonotonic only, any other source
+  //! would let the timerfd fire before the Clock reaches it
+  //! \return false if the source is not SourceMonotonic, the timerfd is disarmed then and the poll timeout is used
+  bool ArmTimerFD();
+
+  //! \brief the timerfd was readable
+  void AcknowledgeTimerFD();
 
   //! \brief get maximal wait time for next timer
-  //! \return 'first' == false -- no wait, 'first' == true, wait maximal 'second' time
+  //! \return 'first' == false -- no wait, 'first' == true, wait maximal 'second' microseconds
   std::pair<bool,long int> GetMaxWaitTime() const;
 
-  //! \brief get next timer, restart cyclic timer
-  //! \return 'first' == false -- no active timer, 'first' == true, in 'second' is timer id
-  std::pair<bool,unsigned char> GetNextTimer();
+  //! \brief deadline of the next timer in Clock::Microseconds, for waiters that read the clock later
+  //! \return 'first' == false -- no timer, a due timer gives the time of the last UpdateTime
+  std::pair<bool,TimerWheel::Tick> GetNextExpiry() const;
+
+  struct ExpiredTimer
+  {
+    TimerHandle theHandle;
+    int theID;                  //!< of StartTimer( aID, ... ), -1 for a handle timer
+    unsigned long theOverruns;  //!< periods a CatchUpReportOverrun timer missed
+    boost::intrusive_ptr<RefCounted> theEvent; //!< Event to deliver, if the timer was started with one
+  };
+
+  //! \brief expire every timer due at the current time in one pass over the wheel
+  //! \return true if PopExpiredTimer has timers to hand out
+  bool CollectExpiredTimers();
+
+  //! \brief next timer expired by CollectExpiredTimers, restart cyclic timer
+  //! a timer stopped before it is popped is not handed out
+  //! \return false if none is left
+  bool PopExpiredTimer( ExpiredTimer & aTimer );
 
 private:
+  //! \brief one slot of the timer table, the timer itself lives on the wheel
   struct TimerStorage
   {
-    TimerStorage( unsigned int aID, boost::posix_time::ptime aTime, unsigned long aDelay,  bool aCyclic )
-      : theID( aID ), theCyclic( aCyclic ), theDelay( aDelay ), theTime( aTime ), theMillisecondsToActivate( 0 )
+    TimerStorage() : theNode( TimerWheel::INVALID_HANDLE ), theGeneration( 0 ), theUsed( false ), theActive( false ), thePaused( false ), theCyclic( false ),
+                     theCatchUp( CatchUpSkip ), theID( -1 ), theDelay( 0 ), theDeadline( 0 ), theSlack( 0 ), theTimeToActivate( 0 )
     {
     }
-    unsigned char theID;
+    TimerWheel::Handle theNode;
+    unsigned int theGeneration;
+    bool theUsed;
+    bool theActive;
+    bool thePaused;
     bool theCyclic;
-    unsigned long theDelay;
-    boost::posix_time::ptime theTime;
-    unsigned long theMillisecondsToActivate;
+    CatchUpPolicy theCatchUp;
+    int theID;
+    TimerWheel::Tick theDelay;
+    //! before the slack is added, cyclic timers keep their phase
+    TimerWheel::Tick theDeadline;
+    TimerWheel::Tick theSlack;
+    TimerWheel::Tick theTimeToActivate;
+    boost::intrusive_ptr<RefCounted> theEvent;
+  };
 
+  enum { TIMER_IDS = 256 };
 
-    bool operator<( const TimerStorage & other ) const { return theTime < other.theTime; }
-  };
+  TimerHandle PushTimer( int aID, TimerWheel::Tick aDelay, bool aCyclic, CatchUpPolicy aPolicy,
+                         const boost::intrusive_ptr<RefCounted> & aEvent = boost::intrusive_ptr<RefCounted>() );
+  void ReleaseSlot( unsigned int aSlot );
+
+  //! \return 0 if aTimer is outdated
+  TimerStorage* Find( const TimerHandle & aTimer );
+  const TimerStorage* Find( const TimerHandle & aTimer ) const;
+
+  //! \brief wheel ticks are microseconds of the Clock
+  TimerWheel::Tick Now() const { return theNow; }
+  TimerWheel::Tick Deadline( TimerWheel::Tick aDelay ) const;
+
+  //! \brief put aTimer on the wheel at its deadline moved within its slack
+  void Schedule( TimerStorage & aTimer, unsigned int aSlot );
+
+  static TimerWheel::Tick Ticks( unsigned long aMilliseconds ) { return aMilliseconds * 1000ULL; }
+  static TimerWheel::Tick Ticks( const boost::posix_time::time_duration & aDelay );
+
+  struct TimerTable;
+  TimerTable & Table();
+
+  TimerWheel::Tick theNow;
+  TimerWheel::Tick theSlack;
 
-  void PushTimer( const TimerStorage & aTimer );
+  int theTimerFD;
+  //! deadline the timerfd is armed to, 0 if disarmed
+  TimerWheel::Tick theArmedExpiry;
 
-  boost::circular_buffer< TimerStorage > theTimerQueue;
-  boost::circular_buffer< TimerStorage > thePausedTimerQueue;
+  //! 0 until the first timer is started
+  TimerTable* theTable;
 };
 
 }
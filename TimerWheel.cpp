@@ -0,0 +1,246 @@
+/*! {{{ File head comment
+  \file TimerWheel.cpp
+
+  \brief
+
+  }}} */
+
+#include "TimerWheel.h"
+#include "Debug.h"
+
+namespace Event
+{
+
+TimerWheel::TimerWheel( Tick aNow /*= 0*/ ) //{{{
+  : theFree( INVALID_HANDLE ), theNow( aNow ), theCount( 0 )
+{
+  for( unsigned int level = 0; level < LEVELS; ++level )
+    theOccupied[level] = 0;
+} //}}}
+
+TimerWheel::Handle TimerWheel::Add( Tick aExpiry, unsigned long aCookie ) //{{{
+{
+  Handle handle;
+  if( theFree != INVALID_HANDLE )
+  {
+    handle = theFree;
+    theFree = theNodes[handle].theNext;
+  }
+  else
+  {
+    handle = theNodes.size();
+    theNodes.push_back( Node() );
+  }
+
+  Node & node = theNodes[handle];
+  node.theExpiry = aExpiry;
+  node.theCookie = aCookie;
+
+  ++theCount;
+
+  if( aExpiry <= theNow )
+    Link( handle, EXPIRED_LIST );
+  else
+    Place( handle );
+
+  return handle;
+} //}}}
+
+void TimerWheel::Remove( Handle aHandle ) //{{{
+{
+  Assert( aHandle < theNodes.size() && theNodes[aHandle].theList != FREE_LIST );
+
+  Unlink( aHandle );
+  --theCount;
+
+  theNodes[aHandle].theList = FREE_LIST;
+  theNodes[aHandle].theNext = theFree;
+  theFree = aHandle;
+} //}}}
+
+void TimerWheel::Advance( Tick aNow ) //{{{
+{
+  Tick next;
+  while( NextExpiry( next ) && next <= aNow )
+  {
+    // all timers of tick 'next' end up in one slot of level 0
+    Jump( next );
+
+    unsigned int slot = next & ( SLOTS - 1 );
+    List & expiring = theSlots[slot];
+
+    while( expiring.theHead != INVALID_HANDLE )
+    {
+      Handle handle = expiring.theHead;
+      Unlink( handle );
+      Link( handle, EXPIRED_LIST );
+    }
+  }
+
+  if( aNow > theNow )
+    Jump( aNow );
+} //}}}
+
+bool TimerWheel::PopExpired( unsigned long & aCookie, Tick & aExpiry ) //{{{
+{
+  Handle handle = theExpired.theHead;
+  if( handle == INVALID_HANDLE )
+    return false;
+
+  aCookie = theNodes[handle].theCookie;
+  aExpiry = theNodes[handle].theExpiry;
+
+  Remove( handle );
+
+  return true;
+} //}}}
+
+bool TimerWheel::NextExpiry( Tick & aExpiry ) const //{{{
+{
+  // timers of a lower level expire before those of a higher one, the lowest occupied slot holds the earliest
+  for( unsigned int level = 0; level < LEVELS; ++level )
+  {
+    if( !theOccupied[level] )
+      continue;
+
+    aExpiry = EarliestOf( theSlots[level * SLOTS + __builtin_ctzll( theOccupied[level] )] );
+    return true;
+  }
+
+  if( theOverflow.theHead == INVALID_HANDLE )
+    return false;
+
+  aExpiry = EarliestOf( theOverflow );
+  return true;
+} //}}}
+
+TimerWheel::Tick TimerWheel::EarliestOf( const List & aList ) const //{{{
+{
+  if( aList.theEarliestKnown )
+    return aList.theEarliest;
+
+  aList.theEarliest = theNodes[aList.theHead].theExpiry;
+  for( Handle handle = theNodes[aList.theHead].theNext; handle != INVALID_HANDLE; handle = theNodes[handle].theNext )
+    if( theNodes[handle].theExpiry < aList.theEarliest )
+      aList.theEarliest = theNodes[handle].theExpiry;
+
+  aList.theEarliestKnown = true;
+  return aList.theEarliest;
+} //}}}
+
+void TimerWheel::Place( Handle aHandle ) //{{{
+{
+  Tick expiry = theNodes[aHandle].theExpiry;
+  Tick differ = expiry ^ theNow;
+
+  unsigned int level = differ ? ( 63 - __builtin_clzll( differ ) ) / SLOT_BITS : 0;
+  if( level >= LEVELS )
+  {
+    Link( aHandle, OVERFLOW_LIST );
+    return;
+  }
+
+  Link( aHandle, level * SLOTS + ( ( expiry >> ( level * SLOT_BITS ) ) & ( SLOTS - 1 ) ) );
+} //}}}
+
+void TimerWheel::Jump( Tick aNow ) //{{{
+{
+  // no timer expires before aNow, so the digits above a level's digit are those of the old time
+  Tick changed = theNow ^ aNow;
+  theNow = aNow;
+
+  if( changed >> ( LEVELS * SLOT_BITS ) )
+    Replace( OVERFLOW_LIST );
+
+  // the slot of the new digit now holds timers of lower levels, top down so they settle in one pass
+  for( unsigned int level = LEVELS - 1; level > 0; --level )
+  {
+    unsigned int slot = ( aNow >> ( level * SLOT_BITS ) ) & ( SLOTS - 1 );
+    if( theOccupied[level] & ( 1ULL << slot ) )
+      Replace( level * SLOTS + slot );
+  }
+} //}}}
+
+void TimerWheel::Replace( unsigned int aList ) //{{{
+{
+  List & list = ListOf( aList );
+
+  Handle handle = list.theHead;
+  list.theHead = list.theTail = INVALID_HANDLE;
+  list.theEarliestKnown = true;
+  if( aList < OVERFLOW_LIST )
+    theOccupied[aList / SLOTS] &= ~( 1ULL << ( aList % SLOTS ) );
+
+  while( handle != INVALID_HANDLE )
+  {
+    Handle next = theNodes[handle].theNext;
+    Place( handle );
+    handle = next;
+  }
+} //}}}
+
+void TimerWheel::Link( Handle aHandle, unsigned int aList ) //{{{
+{
+  List & list = ListOf( aList );
+  Node & node = theNodes[aHandle];
+
+  node.theList = aList;
+  node.theNext = INVALID_HANDLE;
+  node.thePrev = list.theTail;
+
+  if( list.theTail != INVALID_HANDLE )
+  {
+    theNodes[list.theTail].theNext = aHandle;
+    if( node.theExpiry < list.theEarliest )
+      list.theEarliest = node.theExpiry;
+  }
+  else
+  {
+    list.theHead = aHandle;
+    list.theEarliest = node.theExpiry;
+    list.theEarliestKnown = true;
+  }
+  list.theTail = aHandle;
+
+  if( aList < OVERFLOW_LIST )
+    theOccupied[aList / SLOTS] |= 1ULL << ( aList % SLOTS );
+} //}}}
+
+void TimerWheel::Unlink( Handle aHandle ) //{{{
+{
+  Node & node = theNodes[aHandle];
+  List & list = ListOf( node.theList );
+
+  if( node.thePrev != INVALID_HANDLE )
+    theNodes[node.thePrev].theNext = node.theNext;
+  else
+    list.theHead = node.theNext;
+
+  if( node.theNext != INVALID_HANDLE )
+    theNodes[node.theNext].thePrev = node.thePrev;
+  else
+    list.theTail = node.thePrev;
+
+  // another timer of the list may be the earliest now, found when it is asked for
+  if( list.theHead == INVALID_HANDLE )
+    list.theEarliestKnown = true;
+  else if( node.theExpiry == list.theEarliest )
+    list.theEarliestKnown = false;
+
+  if( node.theList < OVERFLOW_LIST && list.theHead == INVALID_HANDLE )
+    theOccupied[node.theList / SLOTS] &= ~( 1ULL << ( node.theList % SLOTS ) );
+} //}}}
+
+TimerWheel::List & TimerWheel::ListOf( unsigned int aList ) //{{{
+{
+  if( aList < OVERFLOW_LIST )
+    return theSlots[aList];
+
+  return aList == OVERFLOW_LIST ? theOverflow : theExpired;
+} //}}}
+
+} // end namespace Event
+
+/* {{{ Modeline for ViM
+ * vim600:fdm=marker fdl=0 fdc=3:
+ * }}} */
@@ -0,0 +1,121 @@
+/*! {{{
+  \file TimerWheel.h
+
+  \brief Hierarchical timing wheel
+
+  }}} */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <boost/cstdint.hpp>
+
+#include <vector>
+
+namespace Event
+{
+
+//! \brief timers on a hierarchical wheel, O(1) to add, remove and expire
+//!
+//! Time is counted in ticks by the caller. LEVELS wheels of SLOTS slots each
+//! cover 64^LEVELS ticks, later timers wait on an overflow list. A timer sits
+//! on the level of the highest 6 bit digit in which its expiry differs from
+//! the current time, in the slot of that digit. When the time reaches the
+//! slot of a higher level, its timers are moved down. Every level keeps a
+//! bitmap of its occupied slots and every list the earliest expiry on it,
+//! so the next expiry is found without scans. Only removing the earliest
+//! timer of a list makes the next NextExpiry scan that list once.
+//!
+//! Timers are nodes of one vector and are linked by index, a Handle is the
+//! node index. Removed nodes are reused.
+class TimerWheel //{{{
+{
+public:
+  typedef boost::uint64_t Tick;
+  typedef unsigned int Handle;
+
+  enum { INVALID_HANDLE = ~0u };
+
+  explicit TimerWheel( Tick aNow = 0 );
+
+  //! \brief start a timer expiring at aExpiry, timers in the past expire with the next Advance
+  Handle Add( Tick aExpiry, unsigned long aCookie );
+
+  //! \brief stop a timer, also an expired one that was not popped yet
+  void Remove( Handle aHandle );
+
+  Tick GetExpiry( Handle aHandle ) const { return theNodes[aHandle].theExpiry; }
+  unsigned long GetCookie( Handle aHandle ) const { return theNodes[aHandle].theCookie; }
+
+  //! \brief move the time forward, timers expiring until aNow become poppable
+  void Advance( Tick aNow );
+
+  //! \brief oldest expired timer, it is removed from the wheel
+  //! \return false if no timer expired
+  bool PopExpired( unsigned long & aCookie, Tick & aExpiry );
+
+  bool HasExpired() const { return theExpired.theHead != INVALID_HANDLE; }
+
+  //! \brief exact expiry of the earliest timer that did not expire yet
+  //! \return false if there is none
+  bool NextExpiry( Tick & aExpiry ) const;
+
+  Tick Now() const { return theNow; }
+  bool Empty() const { return !theCount; }
+  std::size_t Size() const { return theCount; }
+
+private:
+  // 2^36 ticks, about 19 hours of microseconds
+  enum { SLOT_BITS = 6, SLOTS = 1 << SLOT_BITS, LEVELS = 6 };
+
+  //! list index of the overflow list, of the expired list and of free nodes
+  enum { OVERFLOW_LIST = LEVELS * SLOTS, EXPIRED_LIST, FREE_LIST };
+
+  struct Node //{{{
+  {
+    Tick theExpiry;
+    unsigned long theCookie;
+    Handle theNext;
+    Handle thePrev;
+    unsigned int theList;
+  }; //}}}
+
+  struct List //{{{
+  {
+    List() : theHead( INVALID_HANDLE ), theTail( INVALID_HANDLE ), theEarliest( 0 ), theEarliestKnown( true ) {}
+
+    Handle theHead;
+    Handle theTail;
+    //! earliest expiry on the list, recomputed by NextExpiry once it was removed
+    mutable Tick theEarliest;
+    mutable bool theEarliestKnown;
+  }; //}}}
+
+  void Place( Handle aHandle );
+  void Link( Handle aHandle, unsigned int aList );
+  void Unlink( Handle aHandle );
+  void Jump( Tick aNow );
+  void Replace( unsigned int aList );
+  Tick EarliestOf( const List & aList ) const;
+
+  List & ListOf( unsigned int aList );
+
+  std::vector< Node > theNodes;
+  Handle theFree;
+
+  List theSlots[LEVELS * SLOTS];
+  boost::uint64_t theOccupied[LEVELS];
+  List theOverflow;
+  List theExpired;
+
+  Tick theNow;
+  std::size_t theCount;
+}; //}}}
+
+}
+
+#endif /* ifndef TIMERWHEEL_H */
+
+/* {{{ Modeline for ViM
+ * vim600:fdm=marker fdl=0 fdc=3:
+ * }}} */
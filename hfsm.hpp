@@ -22,6 +22,19 @@ struct Bool
 {
   enum { value = v };
 };
+
+// compile time sequence 0..N-1
+template<unsigned... i>
+struct Indices {};
+
+template<unsigned N, unsigned... i>
+struct MakeIndices : MakeIndices<N-1, N-1, i...> {};
+
+template<unsigned... i>
+struct MakeIndices<0, i...>
+{
+  typedef Indices<i...> Res;
+};
 //}}}
 
 //{{{  TopState CompState LeafState
@@ -155,6 +168,82 @@ struct Init
   Host& host_;
 }; //}}}
 
+//{{{ TransitionTable
+// H -> HSM
+// S -> number of signals, H::getSig() < S
+// L -> leaf states
+//
+// One row per leaf state and one cell per signal. A cell runs the handle()
+// chain of its leaf for its signal; as the signal is a constant there, the
+// compiler folds the switch of every level into the case that is taken.
+// A dispatch is then one indexed call instead of the virtual handler and
+// a switch per level. The states are written as for the virtual handler.
+//
+//   void next(const TopState<H>& state) { state_ = &state; row_ = Table::row(state); }
+//   void dispatch(Signal sig)
+//   {
+//     sig_ = sig;
+//     if(sig < Table::signals && row_ < Table::states) Table::dispatch(*this, row_, sig);
+//     else state_->handler(*this);
+//   }
+//
+// dispatch() does not check its row, a state not in L has none. The
+// definition of the host's dispatch() odr-uses rows, which instantiates
+// every cell: it has to follow all explicit specializations of handle,
+// entry, exit and init, otherwise the program is ill-formed (no diagnostic
+// required).
+template<typename H, unsigned S, typename... L>
+struct TransitionTable
+{
+  typedef void (*Cell)(H&);
+  struct Row { Cell cells[S]; };
+
+  enum { states = sizeof...(L), signals = S };
+
+  // row of a leaf state, 'states' if it is not in L; call it on transitions, not per event
+  static unsigned row(const TopState<H>& state) { return Find<L...>::row(state, 0); }
+
+  static void dispatch(H& h, unsigned row, unsigned sig) { rows[row].cells[sig](h); }
+
+  // flatten: the whole handle() chain is inlined here, where the signal is known
+  template<typename Leaf, unsigned sig>
+  __attribute__((flatten)) static void cell(H& h)
+  {
+    // rows are picked by the signal, so this holds; it lets the switches fold
+    if( static_cast<unsigned>(h.getSig()) != sig )
+      __builtin_unreachable();
+    Leaf::obj.handle(h, Leaf::obj);
+  }
+
+private:
+  template<typename Leaf, typename I = typename MakeIndices<S>::Res> struct RowOf;
+
+  template<typename Leaf, unsigned... sig>
+  struct RowOf<Leaf, Indices<sig...> >
+  {
+    static constexpr Row make() { return Row{ { &TransitionTable::template cell<Leaf, sig>... } }; }
+  };
+
+  template<typename... X>
+  struct Find
+  {
+    static unsigned row(const TopState<H>&, unsigned n) { return n; }
+  };
+
+  template<typename X, typename... R>
+  struct Find<X, R...>
+  {
+    static unsigned row(const TopState<H>& state, unsigned n) { return &state == &X::obj ? n : Find<R...>::row(state, n+1); }
+  };
+
+  static const Row rows[states];
+};
+
+// constant initialized, usable before any constructor runs
+template<typename H, unsigned S, typename... L>
+const typename TransitionTable<H,S,L...>::Row TransitionTable<H,S,L...>::rows[] = { TransitionTable<H,S,L...>::template RowOf<L>::make()... };
+//}}}
+
 #endif /* ifndef HFSM_HPP */
 
 /* {{{ Modeline for ViM
@@ -38,11 +38,11 @@ class EventTimedProcessor : public EventProcessor
 public:
   EventTimedProcessor( unsigned int aID ) : EventProcessor( aID ), theCounter( 0 )
   {
+    Subscribe( UserEvent3 );
   }
 
 protected:
   virtual void OnEvent( const EventPointer & aEvent );
-  virtual bool IsUserEventOfInteres( const EventPointer & aEvent ) const;
 
 private:
   int theCounter;
@@ -96,11 +96,6 @@ void EventTimedProcessor::OnEvent( const EventPointer & aEvent ) //{{{
   }
 
 } //}}}
-
-bool EventTimedProcessor::IsUserEventOfInteres( const EventPointer & aEvent ) const
-{
-  return aEvent->ID() == UserEvent3;
-}
 //}}}
 
 //{{{ EventProcessorReciever
@@ -109,10 +104,10 @@ class EventProcessorReciever : public EventProcessor
 public:
   EventProcessorReciever( unsigned int aID ) : EventProcessor( aID )
   {
+    Subscribe( UserEvent1, UserEvent2 );
   }
 protected:
   virtual void OnEvent( const EventPointer & aEvent );
-  virtual bool IsUserEventOfInteres( const EventPointer & aEvent ) const;
 };
 
 void EventProcessorReciever::OnEvent( const EventPointer & aEvent ) //{{{
@@ -134,11 +129,6 @@ void EventProcessorReciever::OnEvent( const EventPointer & aEvent ) //{{{
   }
 
 } //}}}
-
-bool EventProcessorReciever::IsUserEventOfInteres( const EventPointer & aEvent ) const
-{
-  return aEvent->ID() == UserEvent1 || aEvent->ID() == UserEvent2;
-}
 //}}}
 
 //{{{ EventProcessorTestFSM
@@ -147,10 +137,10 @@ class EventProcessorTestFSM : public EventProcessor
 public:
   EventProcessorTestFSM( unsigned int aID ) : EventProcessor( aID )
   {
+    Subscribe( UserSignalA, UserSignalH );
   }
 protected:
   virtual void OnEvent( const EventPointer & aEvent );
-  virtual bool IsUserEventOfInteres( const EventPointer & aEvent ) const;
 
 private:
   TestHSM theTestFSM;
@@ -163,11 +153,6 @@ void EventProcessorTestFSM::OnEvent( const EventPointer & aEvent ) //{{{
 
   theTestFSM.dispatch( (Signal)( aEvent->ID() - 'a' ) );
 } //}}}
-
-bool EventProcessorTestFSM::IsUserEventOfInteres( const EventPointer & aEvent ) const
-{
-  return aEvent->ID() >= UserSignalA && aEvent->ID() <= UserSignalH;
-}
 //}}}
 
 int main( int argc, char *argv[] ) //{{{